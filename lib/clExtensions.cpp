@@ -2,21 +2,51 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#ifndef _WIN32
+#include <dirent.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
 #include <CL/cl.h>
 #include "clExtensions.h"
+#include "gettimeofday.h"
 
 static clCreateSubDevicesEXT_fn pfn_clCreateSubDevicesEXT = NULL;
 
+#define WP_MPOL_PREFERRED 1 //mbind policy, as MPOL_PREFERRED in numaif.h
+
 //#define VERBOSE
 
-//Only one of below scheduling schemes can be enabled
-//#define ROUND_ROBIN
-#define STATIC_ABILITY
-//#define DYNAMIC
-//#define ONE_DEVICE
 
 
+//! The NUMA node of a core, -1 if unknown
+static int core_numa_node(int core)
+{
+#ifdef _WIN32
+	return -1;
+#else
+	char path[64];
+	int node = -1;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", core);
+	DIR *dir = opendir(path);
+	if(dir == NULL)
+		return -1;
+
+	struct dirent *entry;
+	while((entry = readdir(dir)) != NULL)
+	{
+		if(strncmp(entry->d_name, "node", 4) == 0 && sscanf(entry->d_name + 4, "%d", &node) == 1)
+			break;
+		node = -1;
+	}
+	closedir(dir);
 
+	return node;
+#endif
+}
 
 //! Function which sets status
 /*!
@@ -193,6 +223,14 @@ void work_unit::init(work_pool *work_pool,
 	this->work_dim = work_dim;
 	this->global_work_offset = global_work_offset;
 	this->prefer_context = prefer_context;
+	this->flags = flags;
+	this->split_parent = NULL;
+	this->split_groups = 0;
+	this->min_chunk_size = 0;
+	this->max_chunk_size = 0;
+	this->num_parents = 0;
+	this->parents = NULL;
+	this->stream = 0;
 
 	this->global_work_size = global_work_size;
 	this->local_work_size = local_work_size;
@@ -395,6 +433,42 @@ void work_unit::set_argument(cl_int index, cl_int type, cl_int int_value, float
 	}
 }
 
+//! Set the chunk size bounds of a split work unit
+/*!
+A device takes a chunk of the remaining NDRange of a split work unit at a
+time, the chunks shrink as the remaining range shrinks
+\param min_chunk_size, The smallest chunk in work items along the last dimension, 0 for one work group
+\param max_chunk_size, The largest chunk in work items along the last dimension, 0 for no bound
+*/
+void work_unit::set_chunk_bounds(size_t min_chunk_size, size_t max_chunk_size)
+{
+	this->min_chunk_size = min_chunk_size;
+	this->max_chunk_size = max_chunk_size;
+}
+
+//! Make the work unit wait for other work units
+/*!
+The work unit stays in the pool until each parent has been issued to the
+device it runs on, the kernel then waits for the parent's kernel event,
+or has completed. The list is read when the work unit is enqueued.
+\param parent_list, Handles of the parents, returned by enqueue
+\param num_parents, The number of parents, 0 for none
+*/
+void work_unit::depends_on(const work_unit_handle* parent_list, cl_uint num_parents)
+{
+	this->parents = parent_list;
+	this->num_parents = parent_list != NULL ? num_parents : 0;
+}
+
+//! Submit the work unit through a stream of the work pool
+/*!
+\param stream, The stream, returned by work_pool::create_stream, 0 for the default one
+*/
+void work_unit::set_stream(cl_int stream)
+{
+	this->stream = stream;
+}
+
 //! Grab the current time using a system-specific timer
 void cl_getTime(cl_time* time) 
 {
@@ -446,10 +520,9 @@ void * pthread_scheduler(void* work_pool_scheduler_arg)
 
 	data_from_workpool->work_pool_in->work_pool_scheduler(data_from_workpool->thread_id);
 
-	//pthread_exit((void *)work_pool_scheduler_arg);
 	data_from_workpool->work_pool_in->thread_exit[data_from_workpool->thread_id] = 1;
-	//if(data_from_workpool->thread_id != data_from_workpool->work_pool_in->total_num_devices-1)
-	pthread_exit((void *)pthread_scheduler);
+	free(data_from_workpool);
+	pthread_exit(NULL);
 	//ExitThread(10);
 	return NULL;
 }
@@ -458,1455 +531,4334 @@ void * pthread_scheduler(void* work_pool_scheduler_arg)
 
 //! Work Pool Scheduler Function
 /*!
-Reset the buffer used in one frame, and release the buffer
-\param thread_id, The thread id which calls this function (for debugging)
+Scheduler loop of one device, the work pool policy decides which units the device takes
+\param device_id, The index of the device context this thread schedules for
 */
 void work_pool::work_pool_scheduler(int device_id)
 {
 	cl_int status;
 	cl_uint total_index;
+	cl_int decision;
+
 	while(1)
 	{		
 		if(this->done == 1)
 			break;
-		else
-		{
-			total_index = this->query();
-#ifdef ROUND_ROBIN 			
-			if((total_index-1) % (this->total_num_devices) == device_id)
-			{
-				printf("###### [Scheduler]: I'm taking unit no.%d, and give it to device: %d\n", total_index, device_id);
-				this->extract_and_distribute(this->context[device_id], 												      
-					NULL,
-					NULL,
-					NULL,
-					NULL,
-					&status);
-				//if(device_id == 3)
-				clFinish(this->context[device_id].command_queue);
-
-				this->num_on_this_device[device_id]++;
-			}
-#elif defined(ONE_DEVICE)
-			if(device_id == 0)
-			{
-				printf("########### [Scheduler]: I'm taking unit %d, and give it to device: %d\n", this->index_out, device_id);
-				this->extract_and_distribute(this->context[device_id], 												      
-					NULL,
-					NULL,
-					NULL,
-					NULL,
-					&status);
-				//if(this->num_on_this_device[device_id] == total_unfinished_work_units-1)
-				clFinish(this->context[device_id].command_queue);
-
-				this->num_on_this_device[device_id]++;
-
-				//if(this->num_on_this_device[device_id] == (total_unfinished_work_units * 10)/16)
-				//	break;
-			}
 
-#elif defined(STATIC_ABILITY)
-			if(device_id == 0)
-			{
-				printf("########### [Scheduler]: I'm taking unit %d, and give it to device: %d\n", this->index_out, device_id);
-				this->extract_and_distribute(this->context[device_id], 												      
-					NULL,
-					NULL,
-					NULL,
-					NULL,
-					&status);
+		//keep at most inflight_depth work units queued on the device
+		pthread_mutex_lock (&this->inflight_mutex);
+		while(this->num_inflight[device_id] >= this->inflight_depth[device_id] && this->done != 1)
+			pthread_cond_wait(&this->inflight_cv, &this->inflight_mutex);
+		pthread_mutex_unlock (&this->inflight_mutex);
 
-				clFinish(this->context[device_id].command_queue);
+		//help with the chunks of split work units in progress first
+		if(this->num_active_splits != 0 && this->run_split_chunk(device_id, &status))
+			continue;
 
-				this->num_on_this_device[device_id]++;
+		decision = this->policy->select(this, device_id, this->query(device_id));
+		if(decision == POLICY_RETIRE)
+			break;
+		else if(decision == POLICY_SKIP)
+		{
+			usleep(100);
+			continue;
+		}
 
-				if(this->num_on_this_device[device_id] == (total_unfinished_work_units * 8)/16)
-					break;
-			}
-			else if (device_id == 1)
-			{
-				printf("########### [Scheduler]: I'm taking unit %d, and give it to device: %d\n", this->index_out, device_id);
-				this->extract_and_distribute(this->context[device_id], 												      
-					NULL,
-					NULL,
-					NULL,
-					NULL,
-					&status);
-				
-				clFinish(this->context[device_id].command_queue);
-
-				this->num_on_this_device[device_id]++;
-
-				if(this->num_on_this_device[device_id] == (total_unfinished_work_units * 8)/16)
-					break;
-			}
-			/*else if (device_id == 2)
-			{
-				printf("########### [Scheduler]: I'm taking unit %d, and give it to device: %d\n", this->index_out, device_id);
-				this->extract_and_distribute(this->context[device_id], 												      
-												NULL,
-												NULL,
-												NULL,
-												NULL,
-												&status);
-				clFinish(this->context[device_id].command_queue);
-
-				this->num_on_this_device[device_id]++;
-
-				if(this->num_on_this_device[device_id] == (total_unfinished_work_units * 1)/16)
-					break;
-			}*/
-			/*else if ((this->index_out == 21) && (device_id == 3))
-			{
-				printf("########### [Scheduler]: I'm taking unit %d, and give it to device: %d\n", this->index_out, device_id);
-				this->extract_and_distribute(this->context[device_id], 												      
-												NULL,
-												NULL,
-												NULL,
-												NULL,
-												&status);
-				this->num_on_this_device[device_id]++;
-			}*/
-#elif defined(DYNAMIC)
-				if(device_id == 0)
-				{
-					int init_scheduled_num = (total_unfinished_work_units * 10)/16;
+		total_index = this->extract_and_distribute(this->context[device_id], 												      
+			NULL,
+			NULL,
+			NULL,
+			NULL,
+			&status);
+		if(total_index == 0)
+			continue;
 
-					printf("########### [Scheduler]: I'm taking unit %d, and give it to device: %d\n", this->index_out, device_id);
-					this->extract_and_distribute(this->context[device_id], 												      
-						NULL,
-						NULL,
-						NULL,
-						NULL,
-						&status);
+		printf("########### [Scheduler]: I'm taking unit %d, and give it to device: %d\n", total_index, device_id);
 
-					clFinish(this->context[device_id].command_queue);
+		this->num_on_this_device[device_id]++;
+	}
+}
 
-					cl_getTime(&this->unit_end_time[total_index]);
-					this->execution_time_queue_per_device[device_id][this->num_on_this_device[device_id]]=cl_computeTime(unit_start_time[total_index], unit_end_time[total_index]);
-				//printf("!!!!!! execution time of work unit %d: %f on device %d\n", total_index, cl_computeTime(unit_start_time[total_index], unit_end_time[total_index]), device_id);
+//! Completion callback of the commands of a work unit
+/*!
+Called by the OpenCL runtime when the kernel or one of the write-backs of a work unit completes
+*/
+void CL_CALLBACK work_unit_event_callback(cl_event event, cl_int event_status, void* user_data)
+{
+	work_unit *work_unit_done = (work_unit *)user_data;
 
-					this->num_on_this_device[device_id]++;
+	if(event_status < 0)
+	{
+		printf("OpenCL Error: %d, work unit no.%d failed on device %d\n", event_status, work_unit_done->unit_index, work_unit_done->device_id);
+		work_unit_done->execution_status = event_status;
+	}
 
+	if(event == work_unit_done->kernel_event && event_status == CL_COMPLETE)
+	{
+		cl_ulong kernel_start, kernel_end;
+		if(clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &kernel_start, NULL) == CL_SUCCESS &&
+			clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &kernel_end, NULL) == CL_SUCCESS)
+		{
+			work_unit_done->kernel_time = (kernel_end - kernel_start) / 1000000.0;
+		}
+	}
 
-				//Dynamically moved work units across devices
-					if(this->num_on_this_device[device_id] >= 2)
-					{
-						if ((this->execution_time_queue_per_device[device_id][this->num_on_this_device[device_id]] > this->execution_time_queue_per_device[device_id][this->num_on_this_device[device_id]-1]) && (this->execution_time_queue_per_device[device_id][this->num_on_this_device[device_id]-1] > this->execution_time_queue_per_device[device_id][this->num_on_this_device[device_id]-2]))
-						{
-							this->busy_direction[device_id] = UP;
-						}
-					}
+	clReleaseEvent(event);
+	work_unit_done->pool->unit_complete(work_unit_done);
+}
 
-					if(this->busy_direction[device_id] == UP)
-					{
-						for(int i=0;i<this->total_num_devices;i++)
-						{
-							if(i != device_id && (this->busy_direction[i] != UP))
-							{
-								this->dynamic_offset[device_id] --;
-								this->dynamic_offset[i] ++;
-								break;
-							}
-						}
-					}
+//! Retire a work unit whose commands have all completed
+/*!
+Record the end time, let the policy know and free a place in the device's in-flight window.
+The work unit leaves num_pending_units only once nothing touches it or the pool any more
+\param work_unit_done, The work unit, freed by this function once its last command completed
+*/
+void work_pool::unit_complete(work_unit* work_unit_done)
+{
+	if(WP_ATOMIC_ADD(&work_unit_done->pending_events, -1) != 0)
+		return;
 
-					if(this->num_on_this_device[device_id] == init_scheduled_num + this->dynamic_offset[device_id])
-						break;
-				}
-				else if (device_id == 1)
-				{
-					int init_scheduled_num = (total_unfinished_work_units * 5)/16;
+	int device_id = work_unit_done->device_id;
 
-					printf("########### [Scheduler]: I'm taking unit %d, and give it to device: %d\n", this->index_out, device_id);
-					this->extract_and_distribute(this->context[device_id], 												      
-						NULL,
-						NULL,
-						NULL,
-						NULL,
-						&status);
+	if(work_unit_done->split_parent != NULL)
+	{
+		//a chunk only frees its place in the in-flight window of its device
+		work_unit *split_parent = work_unit_done->split_parent;
+		if(work_unit_done->execution_status != CL_SUCCESS)
+			split_parent->execution_status = work_unit_done->execution_status;
+
+		pthread_mutex_lock (&this->inflight_mutex);
+		this->num_inflight[device_id]--;
+		pthread_cond_broadcast(&this->inflight_cv);
+		pthread_mutex_unlock (&this->inflight_mutex);
+
+		free(work_unit_done);
+		this->unit_complete(split_parent);
+		return;
+	}
 
-					clFinish(this->context[device_id].command_queue);
+	cl_uint unit_index = work_unit_done->unit_index;
 
-					cl_getTime(&this->unit_end_time[total_index]);
-					this->execution_time_queue_per_device[device_id][this->num_on_this_device[device_id]]=cl_computeTime(unit_start_time[total_index], unit_end_time[total_index]);
-				//printf("!!!!!! execution time of work unit %d: %f on device %d\n", total_index, cl_computeTime(unit_start_time[total_index], unit_end_time[total_index]), device_id);
+	if(unit_index <= this->total_unfinished_work_units)
+	{
+		cl_getTime(&this->unit_end_time[unit_index]);
 
-					this->num_on_this_device[device_id]++;
+		//without profiling information fall back to the time since distribution
+		if(work_unit_done->kernel_time <= 0)
+			work_unit_done->kernel_time = cl_computeTime(this->unit_start_time[unit_index], this->unit_end_time[unit_index]);
+	}
 
-				//Dynamically moved work units across devices
-					if(this->num_on_this_device[device_id] >= 2)
-					{
-						if ((this->execution_time_queue_per_device[device_id][this->num_on_this_device[device_id]] > this->execution_time_queue_per_device[device_id][this->num_on_this_device[device_id]-1]) && (this->execution_time_queue_per_device[device_id][this->num_on_this_device[device_id]-1] > this->execution_time_queue_per_device[device_id][this->num_on_this_device[device_id]-2]))
-						{
-							this->busy_direction[device_id] = UP;
-						}
-					}
+	pthread_mutex_lock (&this->inflight_mutex);
+	unsigned int num_completed = ++this->num_completed_on_this_device[device_id];
+	if(num_completed <= this->total_unfinished_work_units)
+		this->execution_time_queue_per_device[device_id][num_completed-1] = work_unit_done->kernel_time;
+	this->policy->complete(this, device_id, work_unit_done);
+	//a split work unit takes no place in the in-flight window, its chunks do
+	if(work_unit_done->split_groups == 0)
+		this->num_inflight[device_id]--;
+	pthread_cond_broadcast(&this->inflight_cv);
+	pthread_mutex_unlock (&this->inflight_mutex);
+
+	if(work_unit_done->deadline != 0)
+	{
+		cl_time now;
+		cl_getTime(&now);
+		WP_ATOMIC_ADD(&this->num_deadline_units, 1);
+		if(now > work_unit_done->deadline)
+		{
+			WP_ATOMIC_ADD(&this->num_missed_deadlines, 1);
+#ifdef VERBOSE
+			printf("########### [Complete]: work unit no.%d missed its deadline by %f ms\n", work_unit_done->unit_index, cl_computeTime(work_unit_done->deadline, now));
+#endif
+		}
+	}
 
-					if(this->busy_direction[device_id] == UP)
-					{
-						for(int i=0;i<this->total_num_devices;i++)
-						{
-							if(i != device_id && (this->busy_direction[i] != UP))
-							{
-								this->dynamic_offset[device_id] --;
-								this->dynamic_offset[i] ++;
-								break;
-							}
-						}
-					}
+	//the stream was charged the estimate when the work unit was let out
+	if(work_unit_done->stream_admitted)
+	{
+		pthread_mutex_lock (&this->stream_mutex);
+		work_pool_stream stream = this->streams.at(work_unit_done->stream);
+		stream->deficit += work_unit_done->own_cost - work_unit_done->kernel_time;
+		stream->num_completed++;
+		stream->device_time += work_unit_done->kernel_time;
+		pthread_mutex_unlock (&this->stream_mutex);
+	}
 
-					if(this->num_on_this_device[device_id] == init_scheduled_num + this->dynamic_offset[device_id])
-						break;
-				}
-				else if (device_id == 2)
-				{
-					int init_scheduled_num = (total_unfinished_work_units * 1)/16;
+	if(work_unit_done->split_groups != 0 && work_unit_done->split_ready != NULL)
+		clReleaseEvent(work_unit_done->split_ready);
 
-					printf("########### [Scheduler]: I'm taking unit %d, and give it to device: %d\n", this->index_out, device_id);
-					this->extract_and_distribute(this->context[device_id], 												      
-						NULL,
-						NULL,
-						NULL,
-						NULL,
-						&status);
-					clFinish(this->context[device_id].command_queue);
+	work_unit_done->work_unit_status = CL_WORKUNIT_COMPLETE;
+	if(work_unit_done->future != NULL)
+		work_unit_done->future->resolve(work_unit_done->execution_status);
+	free(work_unit_done);
 
-					cl_getTime(&this->unit_end_time[total_index]);
-					this->execution_time_queue_per_device[device_id][this->num_on_this_device[device_id]]=cl_computeTime(unit_start_time[total_index], unit_end_time[total_index]);
-				//printf("!!!!!! execution time of work unit %d: %f on device %d\n", total_index, cl_computeTime(unit_start_time[total_index], unit_end_time[total_index]), device_id);
+	//last, wait_idle may return and finish tear the pool down as soon as the count drops to 0
+	pthread_mutex_lock (&this->inflight_mutex);
+	if(WP_ATOMIC_ADD(&this->num_pending_units, -1) == 0)
+		pthread_cond_broadcast(&this->idle_cv);
+	pthread_mutex_unlock (&this->inflight_mutex);
+}
 
-					this->num_on_this_device[device_id]++;
+//! Create the completion of a work unit, referenced by the pool and the caller
+work_unit_future::work_unit_future()
+{
+	pthread_mutex_init(&this->lock, NULL);
+	pthread_cond_init(&this->resolved_cv, NULL);
+	this->resolved = CL_FALSE;
+	this->status = CL_SUCCESS;
+	this->num_references = 2;
+	this->issued = CL_FALSE;
+	this->device_id = -1;
+	this->kernel_event = NULL;
+	this->cost = 0;
+	this->rank = 0;
+	this->queued = NULL;
+}
 
-				//Dynamically moved work units across devices
-					if(this->num_on_this_device[device_id] >= 2)
-					{
-						if ((this->execution_time_queue_per_device[device_id][this->num_on_this_device[device_id]] > this->execution_time_queue_per_device[device_id][this->num_on_this_device[device_id]-1]) && (this->execution_time_queue_per_device[device_id][this->num_on_this_device[device_id]-1] > this->execution_time_queue_per_device[device_id][this->num_on_this_device[device_id]-2]))
-						{
-							this->busy_direction[device_id] = UP;
-						}
-					}
+work_unit_future::~work_unit_future()
+{
+	if(this->kernel_event != NULL)
+		clReleaseEvent(this->kernel_event);
+	pthread_mutex_destroy(&this->lock);
+	pthread_cond_destroy(&this->resolved_cv);
+}
 
-					if(this->busy_direction[device_id] == UP)
-					{
-						for(int i=0;i<this->total_num_devices;i++)
-						{
-							if(i != device_id && (this->busy_direction[i] != UP))
-							{
-								this->dynamic_offset[device_id] --;
-								this->dynamic_offset[i] ++;
-								break;
-							}
-						}
-					}
+//! Wait until the work unit has completed
+/*!
+\return CL_SUCCESS, or the error of a failed command of the work unit
+*/
+cl_int work_unit_future::wait()
+{
+	pthread_mutex_lock (&this->lock);
+	while(!this->resolved)
+		pthread_cond_wait(&this->resolved_cv, &this->lock);
+	cl_int status = this->status;
+	pthread_mutex_unlock (&this->lock);
 
-					if(this->num_on_this_device[device_id] == init_scheduled_num + this->dynamic_offset[device_id])
-						break;
-				}
-			/*else if ((this->index_out == 21) && (device_id == 3))
-			{
-				printf("########### [Scheduler]: I'm taking unit %d, and give it to device: %d\n", this->index_out, device_id);
-				this->extract_and_distribute(this->context[device_id], 												      
-												NULL,
-												NULL,
-												NULL,
-												NULL,
-												&status);
-				this->num_on_this_device[device_id]++;
-			}*/
-#else
-				printf("########### [Scheduler]: I'm taking unit %d, and give it to device: %d\n", this->index_out, device_id);
-				this->extract_and_distribute(this->context[device_id], 												      
-					NULL,
-					NULL,
-					NULL,
-					NULL,
-					&status);
-				clFinish(this->context[device_id].command_queue);
-
-				this->num_on_this_device[device_id]++;
-#endif
-			}
+	return status;
+}
 
-		}
-	}
+//! Check if the work unit has completed, without waiting
+cl_bool work_unit_future::test()
+{
+	pthread_mutex_lock (&this->lock);
+	cl_bool resolved = this->resolved;
+	pthread_mutex_unlock (&this->lock);
 
-//! Work Pool Constructor
+	return resolved;
+}
+
+//! Call a function when the work unit completes
 /*!
-Construct a work pool.
-\param status, Error value
-\param max_size, The max capacity of the work pool
+Called at once if the work unit has already completed, otherwise from the OpenCL callback thread
+\param pfn_notify, The function, receives the handle, the completion status and user_data
+\param user_data, Passed to pfn_notify
 */
-work_pool::work_pool( )
+void work_unit_future::then(void (*pfn_notify)(work_unit_handle handle, cl_int status, void* user_data), void* user_data)
 {
+	pthread_mutex_lock (&this->lock);
+	if(!this->resolved)
+	{
+		continuation next;
+		next.pfn_notify = pfn_notify;
+		next.user_data = user_data;
+		this->continuations.push_back(next);
+		pthread_mutex_unlock (&this->lock);
+		return;
+	}
+	cl_int status = this->status;
+	pthread_mutex_unlock (&this->lock);
 
+	pfn_notify(this, status, user_data);
 }
 
-
-//! Work Pool Constructor
+//! A user event which completes with the work unit
 /*!
-Construct a work pool.
-\param status, Error value
-\param max_size, The max capacity of the work pool
+\param context, The context of the event, so it can be waited for in that context's command queues
+\param status, Operation status
+\return The event, released by the caller
 */
-void work_pool::init(int max_size, unsigned int init_number_work_units, cl_int* status)
+cl_event work_unit_future::get_event(cl_context context, cl_int* status)
 {
-	//cl_int local_status;
-	
-	this->done = 0;
-	
-	this->context = work_pool_get_contexts();
+	cl_int local_status;
+	cl_event event = clCreateUserEvent(context, &local_status);
+	set_status(status, local_status);
+	if(local_status != CL_SUCCESS)
+		return NULL;
 
-	for(unsigned int i = 0; i < this->total_num_devices ; i++) 
+	pthread_mutex_lock (&this->lock);
+	if(this->resolved)
 	{
-		printf("Context No.%d \n\tfor device [ %s ] \n\tfrom vendor [ %s ]\n", i, context[i].device_name, context[i].device_vendor);
-	}	
-	
-	this->max_size = max_size;
+		clSetUserEventStatus(event, this->status != CL_SUCCESS ? this->status : CL_COMPLETE);
+	}
+	else
+	{
+		clRetainEvent(event);
+		this->user_events.push_back(event);
+	}
+	pthread_mutex_unlock (&this->lock);
 
-	work_pool_start = (work_unit **)malloc(sizeof(work_unit *)*(max_size+1));
-	if(work_pool_start == NULL) {
-		work_pool_state = WORK_POOL_FAIL;
-		set_status(status, -1);
-		return;
+	return event;
+}
+
+//! Take a reference to the handle, dropped with release
+void work_unit_future::retain()
+{
+	WP_ATOMIC_ADD(&this->num_references, 1);
+}
+
+//! Drop the caller's reference to the handle
+void work_unit_future::release()
+{
+	if(WP_ATOMIC_ADD(&this->num_references, -1) == 0)
+		delete this;
+}
+
+//! Resolve the handle when the work unit completes, and drop the pool's reference
+void work_unit_future::resolve(cl_int status)
+{
+	std::vector<continuation> continuations;
+	std::vector<dependent> children;
+	std::vector<work_unit_future *> parents;
+
+	pthread_mutex_lock (&this->lock);
+	this->status = status;
+	this->resolved = CL_TRUE;
+	for(unsigned int i=0;i<this->user_events.size();i++)
+	{
+		clSetUserEventStatus(this->user_events.at(i), status != CL_SUCCESS ? status : CL_COMPLETE);
+		clReleaseEvent(this->user_events.at(i));
+	}
+	this->user_events.clear();
+	continuations.swap(this->continuations);
+	children.swap(this->children);
+	parents.swap(this->parents);
+	pthread_cond_broadcast(&this->resolved_cv);
+	pthread_mutex_unlock (&this->lock);
+
+	for(unsigned int i=0;i<parents.size();i++)
+		parents.at(i)->release();
+
+	//children bound to the device of the kernel were released when it was issued, and may be gone
+	for(unsigned int i=0;i<children.size();i++)
+	{
+		if(children.at(i).released)
+			continue;
+		if(status != CL_SUCCESS)
+			children.at(i).child->execution_status = status;
+		children.at(i).child->pool->dependency_released(children.at(i).child);
 	}
 
-	this->index_end = 0;
-	this->index_in = 0;
-	this->index_out = 0;
+	for(unsigned int i=0;i<continuations.size();i++)
+		continuations.at(i).pfn_notify(this, status, continuations.at(i).user_data);
 
-	this->work_unit_index = 0;
+	this->release();
+}
 
+//! Bind a work unit to the device of an issued parent
+/*!
+Split work units run on every device, so they only wait for completions
+\return CL_TRUE if the work unit runs on device_id
+*/
+static cl_bool bind_to_device(work_unit* child, int device_id)
+{
+	if(child->flags & CL_WORKUNIT_SPLIT)
+		return CL_FALSE;
 
-	num_work_units = 0;
-	work_pool_state = WORK_POOL_INIT;
-	this->num_sleeping_devices = 0;
+	if(child->dag_device < 0)
+		WP_ATOMIC_CAS(&child->dag_device, -1, device_id);
 
-	this->num_on_this_device = (unsigned int*)malloc(sizeof(int)*total_num_devices);
-	this->thread_exit = (unsigned int*)malloc(sizeof(int)*total_num_devices);
+	return child->dag_device == device_id ? CL_TRUE : CL_FALSE;
+}
 
-	for(int i=0;i<this->total_num_devices;i++)
+//! Add a work unit waiting for this one
+/*!
+\param child, The work unit, held in the pool
+\return CL_TRUE if the child does not have to wait, the work unit has completed or was issued to the child's device
+*/
+cl_bool work_unit_future::add_child(work_unit* child)
+{
+	pthread_mutex_lock (&this->lock);
+	if(this->resolved || (this->issued && bind_to_device(child, this->device_id)))
 	{
-		this->num_on_this_device[i] = 0;
-		this->thread_exit[i] = 0;
+		pthread_mutex_unlock (&this->lock);
+		return CL_TRUE;
 	}
 
-	this->total_unfinished_work_units = init_number_work_units;
+	dependent next;
+	next.child = child;
+	next.released = CL_FALSE;
+	this->children.push_back(next);
+	pthread_mutex_unlock (&this->lock);
 
-	this->unit_start_time = (cl_time *)malloc(sizeof(cl_time)*init_number_work_units);
-	this->unit_end_time = (cl_time *)malloc(sizeof(cl_time)*init_number_work_units);
+	return CL_FALSE;
+}
 
-	for(int i=0;i<this->total_unfinished_work_units;i++)
-	{
-		this->unit_start_time[i] = 0;
-		this->unit_end_time[i] = 0;
-	}
+//! Record the kernel of the work unit being issued to a device
+/*!
+Children which can run on the same device are released at once, their
+kernels wait for kernel_event in the command queue instead of on the host
+\param device_id, The device
+\param kernel_event, The event of the kernel
+*/
+void work_unit_future::issue(int device_id, cl_event kernel_event)
+{
+	std::vector<work_unit *> released;
 
-	this->execution_time_queue_per_device = (double **)malloc(sizeof(double *)*this->total_num_devices);
+	clRetainEvent(kernel_event);
 
-	for(unsigned int i = 0; i < this->total_num_devices ; i++) 
+	pthread_mutex_lock (&this->lock);
+	this->issued = CL_TRUE;
+	this->device_id = device_id;
+	this->kernel_event = kernel_event;
+	for(unsigned int i=0;i<this->children.size();i++)
 	{
-		this->execution_time_queue_per_device[i] = (double *)malloc(sizeof(double)*(init_number_work_units/2));
+		if(bind_to_device(this->children.at(i).child, device_id))
+		{
+			this->children.at(i).released = CL_TRUE;
+			released.push_back(this->children.at(i).child);
+		}
 	}
+	pthread_mutex_unlock (&this->lock);
 
-	this->busy_direction = (unsigned int *)malloc(sizeof(int)*this->total_num_devices);
-	this->dynamic_offset = (int *)malloc(sizeof(int)*this->total_num_devices);
+	for(unsigned int i=0;i<released.size();i++)
+		released.at(i)->pool->dependency_released(released.at(i));
+}
 
-	for(unsigned int i = 0; i < this->total_num_devices ; i++) 
+//! Set the estimated cost of the work unit and link it to its parents
+/*!
+Called once when the work unit is enqueued, before it can get children
+\param cost, The estimated ms of the work unit
+\param parents, The handles of the parents, retained here until the work unit completes
+\param num_parents, The number of parents
+*/
+void work_unit_future::set_cost(double cost, work_unit_future** parents, cl_uint num_parents)
+{
+	this->cost = cost;
+	this->rank = cost;
+	for(unsigned int i=0;i<num_parents;i++)
 	{
-		this->busy_direction[i] = STAY;
-		this->dynamic_offset[i] = 0;
+		parents[i]->retain();
+		this->parents.push_back(parents[i]);
 	}
+}
 
-	init_buffer_table(this->buffer_table);
+//! The upward rank of the work unit, in ms
+double work_unit_future::get_rank()
+{
+	pthread_mutex_lock (&this->lock);
+	double rank = this->rank;
+	pthread_mutex_unlock (&this->lock);
 
-	printf("Scheduler is constantly running in background\n");
-	
-	pthread_mutex_init(&this->work_unit_q_mutex, NULL);
-	pthread_cond_init (&this->work_unit_q_not_empty_cv, NULL);
-	pthread_cond_init (&this->work_unit_q_full_cv, NULL);
+	return rank;
+}
 
-	//pthread_attr_init(&this->work_pool_thread_attr);
-	//pthread_attr_setdetachstate(&this->work_pool_thread_attr, PTHREAD_CREATE_JOINABLE);
+//! Lengthen the remaining path of the work unit by a new child
+/*!
+Passed up to the ancestors still waiting to be issued, whose rank grows as well
+\param child_rank, The upward rank of the child
+*/
+void work_unit_future::raise_rank(double child_rank)
+{
+	std::vector<work_unit_future *> ancestors;
 
-	this->work_pool_scheduler_thread = (pthread_t *)malloc(sizeof(pthread_t)*this->total_num_devices);
-	
-	
-	for(int i=0;i<this->total_num_devices;i++)
+	pthread_mutex_lock (&this->lock);
+	if(this->resolved || this->issued || this->cost + child_rank <= this->rank)
 	{
+		pthread_mutex_unlock (&this->lock);
+		return;
+	}
+	this->rank = this->cost + child_rank;
+	double rank = this->rank;
+	//the work unit can not be issued, nor freed, while the lock is held
+	if(this->queued != NULL)
+		this->queued->pool->rank_raised(this->queued, rank);
+	ancestors = this->parents;
+	for(unsigned int i=0;i<ancestors.size();i++)
+		ancestors.at(i)->retain();
+	pthread_mutex_unlock (&this->lock);
+
+	for(unsigned int i=0;i<ancestors.size();i++)
+	{
+		ancestors.at(i)->raise_rank(rank);
+		ancestors.at(i)->release();
+	}
+}
 
-		scheduler_thread_data *data_from_workpool = (scheduler_thread_data *)malloc(sizeof(scheduler_thread_data));
-		data_from_workpool->work_pool_in = this;
-		data_from_workpool->thread_id = i;
-
-		//printf("\n^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^no of work units: %d\n\n", data_from_workpool->work_pool_in->num_work_units);		
+//! Record the work unit becoming ready
+/*!
+From now on its device queue orders it by rank_key, which follows the rank
+\param unit, The work unit, its home_device set
+*/
+void work_unit_future::set_queued(work_unit* unit)
+{
+	pthread_mutex_lock (&this->lock);
+	this->queued = unit;
+	unit->rank_key = this->rank;
+	pthread_mutex_unlock (&this->lock);
+}
 
-		int rc_workpool;
-		//pthread win32 has problem in joinable threads
-		//rc_workpool = pthread_create(&this->work_pool_scheduler_thread[i], &this->work_pool_thread_attr, pthread_scheduler, (void *)data_from_workpool);
-		rc_workpool = pthread_create(&this->work_pool_scheduler_thread[i], NULL, pthread_scheduler, (void *)data_from_workpool);
-		if (rc_workpool) {
-			printf("ERROR; return code from creating work pool scheduler thread is %d\n", rc_workpool);
-			exit(-1);
-		}
+//! The event a child issued to device_id has to wait for
+/*!
+\return The retained kernel event, NULL if the work unit has completed or runs on another device
+*/
+cl_event work_unit_future::issued_event(int device_id)
+{
+	cl_event event = NULL;
 
-		
+	pthread_mutex_lock (&this->lock);
+	if(!this->resolved && this->issued && this->device_id == device_id)
+	{
+		event = this->kernel_event;
+		clRetainEvent(event);
 	}
-	set_status(status, CL_SUCCESS);
+	pthread_mutex_unlock (&this->lock);
 
+	return event;
 }
 
-//! Get contexts information for all possible devices on the platform
+//! Group work units to wait for together
 /*!
-Get contexts information for all possible devices on the platform
-\return A pointer to the contexts created
+\param num_workunits, The number of work units
+\param workunit_list, The work units, their handles are read when waiting
+\param status, Operation status
+\return The dependency, freed by the caller
 */
-work_pool_context work_pool::work_pool_get_contexts()
+cl_dependency clCreateDependency(cl_int num_workunits,
+	cl_workunit* workunit_list,
+	cl_int* status)
 {
-	//printf("in work_pool_get_contexts\n");
+	static volatile cl_uint num_dependencies = 0;
 
-	cl_int status; 
+	if(num_workunits < 0 || (num_workunits > 0 && workunit_list == NULL))
+	{
+		set_status(status, CL_INVALID_VALUE);
+		return NULL;
+	}
 
-	total_num_devices = 0;
-	cl_uint device_idx = 0;
+	cl_dependency dep = (cl_dependency)malloc(sizeof(_cl_dependency));
+	cl_workunit* list = (cl_workunit *)malloc(sizeof(cl_workunit) * (num_workunits > 0 ? num_workunits : 1));
+	if(dep == NULL || list == NULL)
+	{
+		free(dep);
+		free(list);
+		set_status(status, CL_OUT_OF_HOST_MEMORY);
+		return NULL;
+	}
 
-	status = clGetPlatformIDs(0, NULL, &numPlatforms);
-	printf("Number of platforms detected:%d\n", numPlatforms);
+	memcpy(list, workunit_list, sizeof(cl_workunit) * num_workunits);
+	dep->id = WP_ATOMIC_ADD(&num_dependencies, 1);
+	dep->num_workunits = num_workunits;
+	dep->workunit_list = list;
+	dep->wait_list = NULL;
 
-	if (numPlatforms > 0) 
+	set_status(status, CL_SUCCESS);
+	return dep;
+}
+
+//! Wait until every enqueued work unit of a dependency has completed
+/*!
+Work units not enqueued yet, without a handle, are not waited for
+\param dep, The dependency
+\return CL_SUCCESS, or the error of the first failed work unit
+*/
+cl_int clWaitForDependency(cl_dependency dep)
+{
+	if(dep == NULL)
+		return CL_INVALID_VALUE;
+
+	cl_int status = CL_SUCCESS;
+	for(cl_int i=0;i<dep->num_workunits;i++)
 	{
-	    //this->context = (work_pool_context)malloc(numPlatforms * sizeof(_work_pool_context));
+		if(dep->workunit_list[i] == NULL || dep->workunit_list[i]->handle == NULL)
+			continue;
 
-		platforms = (cl_platform_id*)malloc(numPlatforms * sizeof(cl_platform_id));
-		status = clGetPlatformIDs(numPlatforms, platforms, NULL);
+		cl_int unit_status = dep->workunit_list[i]->handle->wait();
+		dep->workunit_list[i]->status = unit_status;
+		if(status == CL_SUCCESS)
+			status = unit_status;
+	}
 
-		for(unsigned int i = 0; i < numPlatforms ; i++) 
+	return status;
+}
+
+//! Set the in-flight depth of a device
+/*!
+Set how many work units may be queued on a device at the same time
+\param device_id, The device, -1 for all devices
+\param depth, The number of work units, at least 1
+*/
+void work_pool::set_inflight_depth(int device_id, cl_uint depth)
+{
+	if(depth < 1)
+		depth = 1;
+
+	pthread_mutex_lock (&this->inflight_mutex);
+	for(unsigned int i=0;i<this->total_num_devices;i++)
+	{
+		if(device_id < 0 || (unsigned int)device_id == i)
+			this->inflight_depth[i] = depth;
+	}
+	pthread_cond_broadcast(&this->inflight_cv);
+	pthread_mutex_unlock (&this->inflight_mutex);
+}
+
+//! Set the high-water mark of the free device buffers of a device
+/*!
+Buffers released by reset_buffer are kept for the next frame up to this
+many bytes; above it they are trimmed once they stayed above for
+RECYCLE_TRIM_RESETS resets
+\param device_id, The device, -1 for all devices
+\param bytes, The number of bytes, 0 to release the buffers at every reset
+*/
+void work_pool::set_recycle_limit(int device_id, cl_ulong bytes)
+{
+	pthread_mutex_lock (&this->buffer_table_mutex);
+	for(unsigned int i=0;i<this->total_num_devices;i++)
+	{
+		if(device_id < 0 || (unsigned int)device_id == i)
+			this->recycle_limit[i] = bytes;
+	}
+	pthread_mutex_unlock (&this->buffer_table_mutex);
+}
+
+//! Work Pool Constructor
+/*!
+Construct a work pool.
+\param status, Error value
+\param max_size, The max capacity of the work pool
+*/
+work_pool::work_pool( )
+{
+
+}
+
+
+//! Work Pool Constructor
+/*!
+Construct a work pool with the policy named by WORKPOOL_POLICY, or the default policy.
+\param status, Error value
+\param max_size, The max capacity of the work pool
+*/
+void work_pool::init(int max_size, unsigned int init_number_work_units, cl_int* status)
+{
+	this->init(max_size, init_number_work_units, NULL, status);
+}
+
+//! Work Pool Constructor
+/*!
+Construct a work pool.
+\param status, Error value
+\param max_size, The max capacity of the work pool
+\param init_number_work_units, The number of work units expected in one frame
+\param policy_name, The scheduling policy; NULL selects WORKPOOL_POLICY, or the default policy
+*/
+void work_pool::init(int max_size, unsigned int init_number_work_units, const char* policy_name, cl_int* status)
+{
+	//cl_int local_status;
+	
+	this->done = 0;
+
+	if(policy_name == NULL)
+		policy_name = getenv(POLICY_ENV);
+	if(policy_name == NULL)
+		policy_name = DEFAULT_POLICY;
+
+	//cores set with set_thread_affinity win over the environment
+	if(this->thread_cores.empty() && getenv(AFFINITY_ENV) != NULL)
+	{
+		const char *cores = getenv(AFFINITY_ENV);
+		while(*cores != '\0')
 		{
-			cl_uint numDevices;
-			status = clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL, 0, NULL, &numDevices);
-			if(cl_errChk(status, "checking for devices", true)) 					
-				exit(1);										
-			if(numDevices == 0) {		
-				printf("There are no devices for Platform %d\n",i);		
-				exit(0);
-			}
-			else
-			{
-				total_num_devices = total_num_devices + numDevices;
-			}
+			char *end;
+			long core = strtol(cores, &end, 10);
+			if(end == cores)
+				break;
+			this->thread_cores.push_back((int)core);
+			cores = *end == ',' ? end + 1 : end;
 		}
+	}
 
-		this->context = (work_pool_context)malloc(total_num_devices * sizeof(_work_pool_context));
+	this->policy = work_pool_create_policy(policy_name);
+	if(this->policy == NULL) {
+		printf("Unknown scheduling policy: %s\n", policy_name);
+		work_pool_state = WORK_POOL_FAIL;
+		set_status(status, CL_INVALID_VALUE);
+		return;
+	}
+	
+	this->context = work_pool_get_contexts();
 
-		for(unsigned int i = 0; i < numPlatforms ; i++) 
-		{			
-			cl_uint numDevices;
-			status = clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL, 0, NULL, &numDevices);
-			if(cl_errChk(status, "checking for devices", true)) 					
-				exit(1);										
-			if(numDevices == 0) {		
-				printf("There are no devices for Platform %d\n",i);		
-				exit(0);
-			}
-			else
-			{
-				printf("\tNo of devices for Platform %d is %u\n",i, numDevices);	
-				//! Allocate an array of devices of size "numDevices" 
-				devices = (cl_device_id*)malloc(sizeof(cl_device_id)*numDevices);
-				//! Populate Arrray with devices
-				status = clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL, numDevices, 		
-					devices, NULL);	
-				if(cl_errChk(status, "getting device IDs", true)) {					
-					exit(1);	
-				}
-			}
+	//host memory of a device goes to the node of the core its scheduler thread is pinned to
+	this->device_node = (int *)malloc(sizeof(int)*this->total_num_devices);
+	for(unsigned int i = 0; i < this->total_num_devices ; i++) 
+	{
+		this->device_node[i] = (i < this->thread_cores.size() && this->thread_cores[i] >= 0) ? core_numa_node(this->thread_cores[i]) : -1;
+		if(this->device_node[i] >= WP_MAX_NUMA_NODES)
+			this->device_node[i] = -1;
+	}
 
-			for( unsigned int j = 0; j < numDevices; j++) 
-			{
-				this->context[device_idx].platform = platforms[i];
-				this->context[device_idx].device = devices[j];
+	this->staging_free = new std::vector<staging_buffer>[this->total_num_devices * STAGING_CLASSES];
 
-				printf("Context index: %d:\n", device_idx);
+	cl_ulong recycle_limit = DEFAULT_RECYCLE_LIMIT;
+	if(getenv(RECYCLE_LIMIT_ENV) != NULL && atoi(getenv(RECYCLE_LIMIT_ENV)) >= 0)
+		recycle_limit = atoi(getenv(RECYCLE_LIMIT_ENV));
 
-				printf("\tPlatform %d:\t", i);
-				status = clGetPlatformInfo(context[device_idx].platform, CL_PLATFORM_VENDOR, sizeof(context[device_idx].platform_vendor), context[device_idx].platform_vendor, NULL); 
-				printf("Vendor: %s\n", context[device_idx].platform_vendor);
+	this->recycled_buffers = new std::vector<cl_mem>[this->total_num_devices * RECYCLE_CLASSES];
+	this->recycled_bytes = (cl_ulong *)malloc(sizeof(cl_ulong)*this->total_num_devices);
+	this->recycle_limit = (cl_ulong *)malloc(sizeof(cl_ulong)*this->total_num_devices);
+	this->recycle_oversized = (cl_uint *)malloc(sizeof(cl_uint)*this->total_num_devices);
+	for(unsigned int i = 0; i < this->total_num_devices ; i++) 
+	{
+		this->recycled_bytes[i] = 0;
+		this->recycle_limit[i] = recycle_limit << 20;
+		this->recycle_oversized[i] = 0;
+	}
 
-				printf("\tDevice: %d\t", j);		
-				status = clGetDeviceInfo(context[device_idx].device, CL_DEVICE_VENDOR, sizeof(context[device_idx].device_vendor), context[device_idx].device_vendor, NULL);
-				cl_errChk(status, "Getting Device Vendor Info\n", true);
-				printf("Vendor: %s\n", context[device_idx].device_vendor);
-				status = clGetDeviceInfo(context[device_idx].device, CL_DEVICE_NAME, sizeof(context[device_idx].device_name), context[device_idx].device_name, NULL);		
-				cl_errChk(status, "Getting Device Name\n", true);
-				printf("\t\t\tName: %s\n", context[device_idx].device_name);	
-				status = clGetDeviceInfo(context[device_idx].device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(context[device_idx].device_max_compute_units), (void *)&context[device_idx].device_max_compute_units, NULL);		
-				cl_errChk(status, "Getting Device Number of Units\n", true);
-				printf("\t\t\tMax Compute Units: %d\n", context[device_idx].device_max_compute_units);	
-				status = clGetDeviceInfo(context[device_idx].device, CL_DEVICE_MAX_CLOCK_FREQUENCY, sizeof(context[device_idx].device_max_frequency), (void *)&context[device_idx].device_max_frequency, NULL);		
-				cl_errChk(status, "Getting Device Clock Frequency\n", true);
-				printf("\t\t\tMax Clock Frequency: %d\n", context[device_idx].device_max_frequency);	
+	for(unsigned int i = 0; i < this->total_num_devices ; i++) 
+	{
+		printf("Context No.%d \n\tfor device [ %s ] \n\tfrom vendor [ %s ]\n", i, context[i].device_name, context[i].device_vendor);
+	}	
+	
+	this->max_size = max_size;
+	this->capacity = max_size > 0 ? max_size : WORKPOOL_CAP;
+	this->max_capacity = this->capacity;
 
+	this->device_queue = new _work_pool_deque[this->total_num_devices];
+	for(unsigned int i = 0; i < this->total_num_devices ; i++) 
+	{
+		pthread_mutex_init(&this->device_queue[i].lock, NULL);
+		for(unsigned int level = 0; level < PRIORITY_BUCKETS; level++)
+		{
+			this->device_queue[i].bucket[level].head = NULL;
+			this->device_queue[i].bucket[level].tail = NULL;
+		}
+		for(unsigned int word = 0; word < PRIORITY_WORDS; word++)
+			this->device_queue[i].priority_map[word] = 0;
+		this->device_queue[i].starvation = 0;
+		this->device_queue[i].num_units = 0;
+		this->device_queue[i].deadline_first = CL_FALSE;
+	}
 
-				status = clGetDeviceInfo(context[device_idx].device, CL_DEVICE_TYPE, sizeof(context[device_idx].dtype), (void *)&(context[device_idx].dtype), NULL);	
-				if(cl_errChk(status,"Error in Getting Device Info\n", true)) 
-					exit(1);
-				/*if(context[device_idx].dtype == CL_DEVICE_TYPE_GPU) 
-					printf("Creating GPU Context\n");
-				else if (context[device_idx].dtype == CL_DEVICE_TYPE_CPU) 
-					printf("Creating CPU Context\n");
-				else 
-					perror("This Context Type Not Supported\n"); 
-				*/
+	//not full while the pool keeps its initial capacity, after growing the extra units take the locked path
+	if(work_pool_ring_init(&this->submit_ring, this->capacity) != CL_SUCCESS)
+	{
+		work_pool_state = WORK_POOL_FAIL;
+		set_status(status, CL_OUT_OF_HOST_MEMORY);
+		return;
+	}
 
-				if(context[device_idx].dtype == CL_DEVICE_TYPE_GPU) 
-				{
-					printf("Creating GPU Context\n");
-					cl_context_properties cps[3] = {CL_CONTEXT_PLATFORM, (cl_context_properties)(context[device_idx].platform), 0};
-					cl_context_properties *cprops = cps;
-					context[device_idx].context = clCreateContextFromType(cprops, (cl_device_type)(context[device_idx].dtype), NULL, NULL, &status);		
-					if(cl_errChk(status, "creating Context", true))
-						exit(1);
+	this->work_unit_index = 0;
 
-					context[device_idx].command_queue = clCreateCommandQueue(context[device_idx].context, context[device_idx].device, CL_QUEUE_PROFILING_ENABLE | CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE, &status);
-					if(cl_errChk(status, "creating command queue", true))
-						exit(1);
 
-					context[device_idx].work_pool_context_idx = device_idx;
-					device_idx++;
-				}
-				else if (context[device_idx].dtype == CL_DEVICE_TYPE_CPU) 
-				{
-					printf("Creating sub-CPU Context\n");
+	num_work_units = 0;
+	this->num_held_units = 0;
+	work_pool_state = WORK_POOL_INIT;
+	this->num_sleeping_devices = 0;
+	this->ready_version = 0;
 
-					char* deviceExtensions = NULL;;
-					size_t extStringSize = 0;
+	this->num_on_this_device = (unsigned int*)malloc(sizeof(int)*total_num_devices);
+	this->num_completed_on_this_device = (unsigned int*)malloc(sizeof(int)*total_num_devices);
+	this->thread_exit = (unsigned int*)malloc(sizeof(int)*total_num_devices);
+	this->num_inflight = (cl_uint*)malloc(sizeof(cl_uint)*total_num_devices);
+	this->inflight_depth = (cl_uint*)malloc(sizeof(cl_uint)*total_num_devices);
 
-					// Get device extensions 
-					status = clGetDeviceInfo(context[device_idx].device, CL_DEVICE_EXTENSIONS, 0, deviceExtensions,  &extStringSize);	
-					if(cl_errChk(status, "checking extensions", true))
-						exit(1);
-					
-					deviceExtensions = new char[extStringSize];
-					if(NULL == deviceExtensions)
-					{
-						printf("Failed when allocating string for checking extensions\n");
-						exit(1);
-					}
+	cl_uint depth = DEFAULT_INFLIGHT_DEPTH;
+	if(getenv(INFLIGHT_ENV) != NULL && atoi(getenv(INFLIGHT_ENV)) > 0)
+		depth = atoi(getenv(INFLIGHT_ENV));
 
-					status = clGetDeviceInfo(context[device_idx].device, CL_DEVICE_EXTENSIONS, extStringSize, deviceExtensions,  NULL);	
-					if(cl_errChk(status, "checking extensions", true))
-						exit(1);
+	for(int i=0;i<this->total_num_devices;i++)
+	{
+		this->num_on_this_device[i] = 0;
+		this->num_completed_on_this_device[i] = 0;
+		this->thread_exit[i] = 0;
+		this->num_inflight[i] = 0;
+		this->inflight_depth[i] = depth;
+	}
 
-					//printf("extension: %s\n", deviceExtensions);
+	this->total_unfinished_work_units = init_number_work_units;
 
-					if(!strstr(deviceExtensions, "cl_ext_device_fission"))
-					{
-						printf("This CPU device doesn't support fission!\n");
-						exit(1);
-					}
+	//unit indices start from 1
+	this->unit_start_time = (cl_time *)malloc(sizeof(cl_time)*(init_number_work_units+1));
+	this->unit_end_time = (cl_time *)malloc(sizeof(cl_time)*(init_number_work_units+1));
 
-					delete deviceExtensions;
+	for(unsigned int i=0;i<=this->total_unfinished_work_units;i++)
+	{
+		this->unit_start_time[i] = 0;
+		this->unit_end_time[i] = 0;
+	}
 
-					// Initialize required partition property
-					cl_device_partition_property_ext partitionPrty[] =
-					{ CL_DEVICE_PARTITION_BY_COUNTS_EXT,
-						2, CL_PARTITION_BY_COUNTS_LIST_END_EXT,
-						CL_PROPERTIES_LIST_END_EXT 
-					};
+	this->execution_time_queue_per_device = (double **)malloc(sizeof(double *)*this->total_num_devices);
 
-					// Initialize clCreateSubDevicesEXT function pointer
-					INIT_CL_EXT_FCN_PTR(this->context[device_idx].platform, clCreateSubDevicesEXT);
+	for(unsigned int i = 0; i < this->total_num_devices ; i++) 
+	{
+		this->execution_time_queue_per_device[i] = (double *)malloc(sizeof(double)*(init_number_work_units+1));
+	}
 
-					cl_uint numSubDevices = 0;
-					// Get number of sub-devices
-					status = pfn_clCreateSubDevicesEXT(context[device_idx].device, partitionPrty, 0, NULL, &numSubDevices);
+	this->transfer_rate = (double *)malloc(sizeof(double)*this->total_num_devices);
+	for(unsigned int i = 0; i < this->total_num_devices ; i++) 
+	{
+		this->transfer_rate[i] = DEFAULT_TRANSFER_RATE;
+	}
 
-					if(cl_errChk(status, "checking number of sub devices in fission extensions", true))
-						exit(1);
+	//split work units are shared by compute capability until set_split_weight is called
+	this->split_weight = (double *)malloc(sizeof(double)*this->total_num_devices);
+	for(unsigned int i = 0; i < this->total_num_devices ; i++) 
+	{
+		this->split_weight[i] = (double)this->context[i].device_max_compute_units * this->context[i].device_max_frequency;
+		if(this->split_weight[i] <= 0)
+			this->split_weight[i] = 1;
+	}
 
-					printf("No of subdevice: %d\n", numSubDevices);
+	this->num_active_splits = 0;
+	this->num_pending_units = 0;
 
-					cl_device_id *subDevices= (cl_device_id*)malloc(numSubDevices * sizeof(cl_device_id));
-					if(NULL == subDevices)
-					{
-						printf("Failed to allocate memory(subDevices)\n");
-						exit(1);
-					}
+	this->deadline_first = this->policy->earliest_deadline_first();
+	for(unsigned int i=0;i<this->total_num_devices;i++)
+		this->device_queue[i].deadline_first = this->deadline_first;
+	this->num_deadline_units = 0;
+	this->num_missed_deadlines = 0;
 
-					status = pfn_clCreateSubDevicesEXT(context[device_idx].device, partitionPrty, numSubDevices,subDevices, NULL);
-					if(cl_errChk(status, "Creating sub devices using fission extensions", true))
-						exit(1);
+	this->num_streams = 0;
+	this->stream_turn = 0;
+	this->stream_turn_given = CL_FALSE;
+	this->num_stream_waiting = 0;
+	this->num_stream_admitted = 0;
 
-					/* Create sub device using OpenCL Fission, updated by Enqiang 07/25/2011*/
-					/*
+	init_buffer_table(this->buffer_table);
+
+	this->policy->init(this);
+
+	printf("Scheduler is constantly running in background, policy: %s\n", this->policy->name());
+	
+	pthread_mutex_init(&this->work_unit_q_mutex, NULL);
+	pthread_mutex_init(&this->buffer_table_mutex, NULL);
+	pthread_mutex_init(&this->inflight_mutex, NULL);
+	pthread_mutex_init(&this->split_mutex, NULL);
+	pthread_mutex_init(&this->stream_mutex, NULL);
+	pthread_mutex_init(&this->staging_mutex, NULL);
+	pthread_cond_init (&this->inflight_cv, NULL);
+	pthread_cond_init (&this->idle_cv, NULL);
+	pthread_cond_init (&this->work_unit_q_not_empty_cv, NULL);
+	pthread_cond_init (&this->work_unit_q_full_cv, NULL);
+
+
+	this->work_pool_scheduler_thread = (pthread_t *)malloc(sizeof(pthread_t)*this->total_num_devices);
+	
+	
+	for(int i=0;i<this->total_num_devices;i++)
+	{
+		pthread_attr_init(&this->work_pool_thread_attr);
+#ifndef _WIN32
+		if(i < (int)this->thread_cores.size() && this->thread_cores[i] >= 0 && this->thread_cores[i] < CPU_SETSIZE)
+		{
+			cpu_set_t cores;
+			CPU_ZERO(&cores);
+			CPU_SET(this->thread_cores[i], &cores);
+			if(pthread_attr_setaffinity_np(&this->work_pool_thread_attr, sizeof(cpu_set_t), &cores) != 0)
+				printf("Could not pin the scheduler thread of device %d to core %d\n", i, this->thread_cores[i]);
+		}
+#endif
+
+		scheduler_thread_data *data_from_workpool = (scheduler_thread_data *)malloc(sizeof(scheduler_thread_data));
+		data_from_workpool->work_pool_in = this;
+		data_from_workpool->thread_id = i;
+
+		//printf("\n^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^no of work units: %d\n\n", data_from_workpool->work_pool_in->num_work_units);		
+
+		//joinable, finish joins the threads
+		int rc_workpool;
+		rc_workpool = pthread_create(&this->work_pool_scheduler_thread[i], &this->work_pool_thread_attr, pthread_scheduler, (void *)data_from_workpool);
+		pthread_attr_destroy(&this->work_pool_thread_attr);
+		if (rc_workpool) {
+			printf("ERROR; return code from creating work pool scheduler thread is %d\n", rc_workpool);
+			exit(-1);
+		}
+
+		
+	}
+	set_status(status, CL_SUCCESS);
+
+}
+
+//! Set the cores the scheduler threads are pinned to
+/*!
+Called before init, takes precedence over WORKPOOL_AFFINITY. The pinned
+cores are kept out of the CPU sub-device, and the host memory the pool
+allocates for a device is placed on the NUMA node of its thread's core.
+\param cores, The core of each scheduler thread in device order, -1 not to pin a thread
+\param num_cores, The number of cores, the threads of the devices beyond it are not pinned
+*/
+void work_pool::set_thread_affinity(const int* cores, cl_uint num_cores)
+{
+	this->thread_cores.assign(cores, cores + num_cores);
+}
+
+//! Allocate host memory used for a device
+/*!
+On the NUMA node of the device when it is known, from malloc otherwise
+\param device_id, The device the memory is copied to or from
+\param size, The size in bytes
+\return The memory, freed with host_free, NULL if it can not be allocated
+*/
+void* work_pool::host_alloc(int device_id, size_t size)
+{
+#ifndef _WIN32
+	if(this->device_node[device_id] >= 0 && size > 0)
+	{
+		void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(data == MAP_FAILED)
+			return NULL;
+
+		//the pages are placed when first touched, preferably on the device's node
+		unsigned long nodes[WP_MAX_NUMA_NODES / (8 * sizeof(unsigned long))] = {0};
+		nodes[this->device_node[device_id] / (8 * sizeof(unsigned long))] |= 1ul << (this->device_node[device_id] % (8 * sizeof(unsigned long)));
+		syscall(SYS_mbind, data, size, WP_MPOL_PREFERRED, nodes, WP_MAX_NUMA_NODES + 1, 0);
+		return data;
+	}
+#endif
+
+	return malloc(size);
+}
+
+//! Free host memory from host_alloc
+/*!
+\param device_id, The device given to host_alloc
+\param data, The memory
+\param size, The size given to host_alloc
+*/
+void work_pool::host_free(int device_id, void* data, size_t size)
+{
+	if(data == NULL)
+		return;
+
+#ifndef _WIN32
+	if(this->device_node[device_id] >= 0 && size > 0)
+	{
+		munmap(data, size);
+		return;
+	}
+#endif
+
+	free(data);
+}
+
+//! Size class of a staging buffer
+/*!
+\param size, The bytes to transfer, at most MIGRATION_CHUNK_SIZE
+\return The smallest class holding size
+*/
+static int staging_class(size_t size)
+{
+	int size_class = 0;
+	while(size_class < STAGING_CLASSES - 1 && ((size_t)STAGING_MIN_SIZE << size_class) < size)
+		size_class++;
+
+	return size_class;
+}
+
+//! Take a staging buffer of a device
+/*!
+Reuse a free buffer of the size class, or create one. It is pinned host
+memory: on the device's NUMA node when it is known, allocated by the
+runtime otherwise.
+\param device_id, The device the transfers go to or come from
+\param size, The bytes to transfer, at most MIGRATION_CHUNK_SIZE
+\return The staging buffer, given back with release_staging, NULL if none can be created
+*/
+staging_buffer work_pool::acquire_staging(int device_id, size_t size)
+{
+	int size_class = staging_class(size);
+	std::vector<staging_buffer> *free_list = &this->staging_free[device_id * STAGING_CLASSES + size_class];
+	staging_buffer staging = NULL;
+
+	pthread_mutex_lock (&this->staging_mutex);
+	if(!free_list->empty())
+	{
+		staging = free_list->back();
+		free_list->pop_back();
+	}
+	pthread_mutex_unlock (&this->staging_mutex);
+
+	if(staging != NULL)
+		return staging;
+
+	cl_int status;
+	size_t class_size = (size_t)STAGING_MIN_SIZE << size_class;
+	_work_pool_context staging_context = this->context[device_id];
+	void *memory = this->device_node[device_id] >= 0 ? this->host_alloc(device_id, class_size) : NULL;
+
+	cl_mem buffer;
+	if(memory != NULL)
+		buffer = clCreateBuffer(staging_context.context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, class_size, memory, &status);
+	else
+		buffer = clCreateBuffer(staging_context.context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, class_size, NULL, &status);
+	if(status != CL_SUCCESS)
+	{
+		this->host_free(device_id, memory, class_size);
+		return NULL;
+	}
+
+	void *host_ptr = clEnqueueMapBuffer(staging_context.command_queue, buffer, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, class_size, 0, NULL, NULL, &status);
+	if(status != CL_SUCCESS)
+	{
+		clReleaseMemObject(buffer);
+		this->host_free(device_id, memory, class_size);
+		return NULL;
+	}
+
+	staging = (staging_buffer)malloc(sizeof(_staging_buffer));
+	staging->buffer = buffer;
+	staging->host_ptr = host_ptr;
+	staging->memory = memory;
+	staging->size = class_size;
+	staging->device_id = device_id;
+	staging->pool = this;
+
+	return staging;
+}
+
+//! Give a staging buffer back for reuse
+/*!
+Called once the commands using it have completed, also from the OpenCL callback thread
+\param staging, The staging buffer
+*/
+void work_pool::release_staging(staging_buffer staging)
+{
+	pthread_mutex_lock (&this->staging_mutex);
+	this->staging_free[staging->device_id * STAGING_CLASSES + staging_class(staging->size)].push_back(staging);
+	pthread_mutex_unlock (&this->staging_mutex);
+}
+
+//! Release all the staging buffers
+void work_pool::free_staging()
+{
+	pthread_mutex_lock (&this->staging_mutex);
+	for(unsigned int k=0;k<this->total_num_devices * STAGING_CLASSES;k++)
+	{
+		for(unsigned int j=0;j<this->staging_free[k].size();j++)
+		{
+			staging_buffer staging = this->staging_free[k].at(j);
+			clEnqueueUnmapMemObject(this->context[staging->device_id].command_queue, staging->buffer, staging->host_ptr, 0, NULL, NULL);
+			clFinish(this->context[staging->device_id].command_queue);
+			clReleaseMemObject(staging->buffer);
+			this->host_free(staging->device_id, staging->memory, staging->size);
+			free(staging);
+		}
+		this->staging_free[k].clear();
+	}
+	pthread_mutex_unlock (&this->staging_mutex);
+}
+
+//! A write-back through staging buffers, complete when every chunk is in the host array
+typedef struct {
+	cl_event done;
+	volatile cl_int num_chunks;
+	cl_int status;
+} _staged_copy, *staged_copy;
+
+//! One chunk of a write-back through a staging buffer
+typedef struct {
+	staging_buffer staging;
+	void *data;
+	size_t size;
+	staged_copy copy;
+} _staged_chunk, *staged_chunk;
+
+//! Count down the chunks of a write-back, the last one completes its event
+static void staged_copy_done(staged_copy copy)
+{
+	if(WP_ATOMIC_ADD(&copy->num_chunks, -1) == 0)
+	{
+		clSetUserEventStatus(copy->done, copy->status < 0 ? copy->status : CL_COMPLETE);
+		clReleaseEvent(copy->done);
+		free(copy);
+	}
+}
+
+//! Completion callback of the read of a chunk of a write-back
+/*!
+Copy the chunk from its staging buffer into the host array and give the
+staging buffer back
+*/
+static void CL_CALLBACK staged_read_callback(cl_event event, cl_int event_status, void* user_data)
+{
+	staged_chunk chunk = (staged_chunk)user_data;
+	staged_copy copy = chunk->copy;
+
+	if(event_status < 0)
+		copy->status = event_status;
+	else if(chunk->staging != NULL)
+		memcpy(chunk->data, chunk->staging->host_ptr, chunk->size);
+
+	if(chunk->staging != NULL)
+		chunk->staging->pool->release_staging(chunk->staging);
+	free(chunk);
+
+	staged_copy_done(copy);
+}
+
+//! Completion callback of the write of a staging buffer to a device
+static void CL_CALLBACK staged_write_callback(cl_event event, cl_int event_status, void* user_data)
+{
+	staging_buffer staging = (staging_buffer)user_data;
+
+	staging->pool->release_staging(staging);
+}
+
+//! Read a device buffer back into a host array through staging buffers
+/*!
+The buffer is read into pinned staging buffers in MIGRATION_CHUNK_SIZE
+chunks, each copied into the host array as soon as its read completes
+\param device_id, The device of the buffer
+\param buffer, The device buffer
+\param buffer_offset, The first byte to read in the buffer
+\param data, The host memory to read to
+\param size, The bytes to read
+\param after, The event the reads wait for, may be NULL
+\param status, Operation status
+\return An event of the device's context, complete once the host array holds the data
+*/
+cl_event work_pool::staged_write_back(int device_id, cl_mem buffer, size_t buffer_offset, void* data, cl_int size, cl_event after, cl_int* status)
+{
+	_work_pool_context copy_context = this->context[device_id];
+
+	staged_copy copy = (staged_copy)malloc(sizeof(_staged_copy));
+	copy->done = clCreateUserEvent(copy_context.context, status);
+	cl_errChk(*status, "Creating write-back event", true);
+	copy->status = CL_SUCCESS;
+	//one count while the chunks are queued, so the event can not complete before the last one is
+	copy->num_chunks = 1;
+
+	//one reference for the caller, one for completing it
+	clRetainEvent(copy->done);
+	cl_event done = copy->done;
+
+	for(cl_int offset=0;offset<size;offset+=MIGRATION_CHUNK_SIZE)
+	{
+		staged_chunk chunk = (staged_chunk)malloc(sizeof(_staged_chunk));
+		chunk->size = size - offset < MIGRATION_CHUNK_SIZE ? size - offset : MIGRATION_CHUNK_SIZE;
+		chunk->data = (char *)data + offset;
+		chunk->copy = copy;
+
+		//without pinned memory left, read straight into the host array
+		chunk->staging = this->acquire_staging(device_id, chunk->size);
+		void *target = chunk->staging != NULL ? chunk->staging->host_ptr : chunk->data;
+
+		cl_event read_event;
+		*status = clEnqueueReadBuffer(copy_context.command_queue, buffer, CL_FALSE, buffer_offset + offset, chunk->size, target,
+			after != NULL ? 1 : 0, after != NULL ? &after : NULL, &read_event);
+		cl_errChk(*status, "Reading output from buffer", true);
+
+		WP_ATOMIC_ADD(&copy->num_chunks, 1);
+		*status = clSetEventCallback(read_event, CL_COMPLETE, staged_read_callback, chunk);
+		cl_errChk(*status, "Setting write-back chunk callback", true);
+		clReleaseEvent(read_event);
+	}
+
+	staged_copy_done(copy);
+
+	return done;
+}
+
+//! Get contexts information for all possible devices on the platform
+/*!
+Get contexts information for all possible devices on the platform
+\return A pointer to the contexts created
+*/
+work_pool_context work_pool::work_pool_get_contexts()
+{
+	//printf("in work_pool_get_contexts\n");
+
+	cl_int status; 
+
+	total_num_devices = 0;
+	cl_uint device_idx = 0;
+
+	status = clGetPlatformIDs(0, NULL, &numPlatforms);
+	printf("Number of platforms detected:%d\n", numPlatforms);
+
+	if (numPlatforms > 0) 
+	{
+	    //this->context = (work_pool_context)malloc(numPlatforms * sizeof(_work_pool_context));
+
+		platforms = (cl_platform_id*)malloc(numPlatforms * sizeof(cl_platform_id));
+		status = clGetPlatformIDs(numPlatforms, platforms, NULL);
+
+		for(unsigned int i = 0; i < numPlatforms ; i++) 
+		{
+			cl_uint numDevices;
+			status = clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL, 0, NULL, &numDevices);
+			if(cl_errChk(status, "checking for devices", true)) 					
+				exit(1);										
+			if(numDevices == 0) {		
+				printf("There are no devices for Platform %d\n",i);		
+				exit(0);
+			}
+			else
+			{
+				total_num_devices = total_num_devices + numDevices;
+			}
+		}
+
+		this->context = (work_pool_context)malloc(total_num_devices * sizeof(_work_pool_context));
+
+		for(unsigned int i = 0; i < numPlatforms ; i++) 
+		{			
+			cl_uint numDevices;
+			status = clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL, 0, NULL, &numDevices);
+			if(cl_errChk(status, "checking for devices", true)) 					
+				exit(1);										
+			if(numDevices == 0) {		
+				printf("There are no devices for Platform %d\n",i);		
+				exit(0);
+			}
+			else
+			{
+				printf("\tNo of devices for Platform %d is %u\n",i, numDevices);	
+				//! Allocate an array of devices of size "numDevices" 
+				devices = (cl_device_id*)malloc(sizeof(cl_device_id)*numDevices);
+				//! Populate Arrray with devices
+				status = clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL, numDevices, 		
+					devices, NULL);	
+				if(cl_errChk(status, "getting device IDs", true)) {					
+					exit(1);	
+				}
+			}
+
+			for( unsigned int j = 0; j < numDevices; j++) 
+			{
+				this->context[device_idx].platform = platforms[i];
+				this->context[device_idx].device = devices[j];
+
+				printf("Context index: %d:\n", device_idx);
+
+				printf("\tPlatform %d:\t", i);
+				status = clGetPlatformInfo(context[device_idx].platform, CL_PLATFORM_VENDOR, sizeof(context[device_idx].platform_vendor), context[device_idx].platform_vendor, NULL); 
+				printf("Vendor: %s\n", context[device_idx].platform_vendor);
+
+				printf("\tDevice: %d\t", j);		
+				status = clGetDeviceInfo(context[device_idx].device, CL_DEVICE_VENDOR, sizeof(context[device_idx].device_vendor), context[device_idx].device_vendor, NULL);
+				cl_errChk(status, "Getting Device Vendor Info\n", true);
+				printf("Vendor: %s\n", context[device_idx].device_vendor);
+				status = clGetDeviceInfo(context[device_idx].device, CL_DEVICE_NAME, sizeof(context[device_idx].device_name), context[device_idx].device_name, NULL);		
+				cl_errChk(status, "Getting Device Name\n", true);
+				printf("\t\t\tName: %s\n", context[device_idx].device_name);	
+				status = clGetDeviceInfo(context[device_idx].device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(context[device_idx].device_max_compute_units), (void *)&context[device_idx].device_max_compute_units, NULL);		
+				cl_errChk(status, "Getting Device Number of Units\n", true);
+				printf("\t\t\tMax Compute Units: %d\n", context[device_idx].device_max_compute_units);	
+				status = clGetDeviceInfo(context[device_idx].device, CL_DEVICE_MAX_CLOCK_FREQUENCY, sizeof(context[device_idx].device_max_frequency), (void *)&context[device_idx].device_max_frequency, NULL);		
+				cl_errChk(status, "Getting Device Clock Frequency\n", true);
+				printf("\t\t\tMax Clock Frequency: %d\n", context[device_idx].device_max_frequency);	
+
+
+				status = clGetDeviceInfo(context[device_idx].device, CL_DEVICE_TYPE, sizeof(context[device_idx].dtype), (void *)&(context[device_idx].dtype), NULL);	
+				if(cl_errChk(status,"Error in Getting Device Info\n", true)) 
+					exit(1);
+				/*if(context[device_idx].dtype == CL_DEVICE_TYPE_GPU) 
+					printf("Creating GPU Context\n");
+				else if (context[device_idx].dtype == CL_DEVICE_TYPE_CPU) 
+					printf("Creating CPU Context\n");
+				else 
+					perror("This Context Type Not Supported\n"); 
+				*/
+
+				if(context[device_idx].dtype == CL_DEVICE_TYPE_GPU) 
+				{
+					printf("Creating GPU Context\n");
 					cl_context_properties cps[3] = {CL_CONTEXT_PLATFORM, (cl_context_properties)(context[device_idx].platform), 0};
 					cl_context_properties *cprops = cps;
 					context[device_idx].context = clCreateContextFromType(cprops, (cl_device_type)(context[device_idx].dtype), NULL, NULL, &status);		
 					if(cl_errChk(status, "creating Context", true))
 						exit(1);
 
-					context[device_idx].command_queue = clCreateCommandQueue(context[device_idx].context, context[device_idx].device, CL_QUEUE_PROFILING_ENABLE | CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE, &status);
-					if(cl_errChk(status, "creating command queue", true))
-						exit(1);
-					*/
+					context[device_idx].command_queue = clCreateCommandQueue(context[device_idx].context, context[device_idx].device, CL_QUEUE_PROFILING_ENABLE | CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE, &status);
+					if(cl_errChk(status, "creating command queue", true))
+						exit(1);
+
+					context[device_idx].work_pool_context_idx = device_idx;
+					device_idx++;
+				}
+				else if (context[device_idx].dtype == CL_DEVICE_TYPE_CPU) 
+				{
+					printf("Creating sub-CPU Context\n");
+
+					char* deviceExtensions = NULL;;
+					size_t extStringSize = 0;
+
+					// Get device extensions 
+					status = clGetDeviceInfo(context[device_idx].device, CL_DEVICE_EXTENSIONS, 0, deviceExtensions,  &extStringSize);	
+					if(cl_errChk(status, "checking extensions", true))
+						exit(1);
+					
+					deviceExtensions = new char[extStringSize];
+					if(NULL == deviceExtensions)
+					{
+						printf("Failed when allocating string for checking extensions\n");
+						exit(1);
+					}
+
+					status = clGetDeviceInfo(context[device_idx].device, CL_DEVICE_EXTENSIONS, extStringSize, deviceExtensions,  NULL);	
+					if(cl_errChk(status, "checking extensions", true))
+						exit(1);
+
+					//printf("extension: %s\n", deviceExtensions);
+
+					if(!strstr(deviceExtensions, "cl_ext_device_fission"))
+					{
+						printf("This CPU device doesn't support fission!\n");
+						exit(1);
+					}
+
+					delete deviceExtensions;
+
+					// Initialize required partition property
+					cl_device_partition_property_ext partitionPrty[CPU_PARTITION_UNITS + 3] =
+					{ CL_DEVICE_PARTITION_BY_COUNTS_EXT,
+						CPU_PARTITION_UNITS, CL_PARTITION_BY_COUNTS_LIST_END_EXT,
+						CL_PROPERTIES_LIST_END_EXT 
+					};
+
+					//keep the cores of the scheduler threads out of the sub-device, compute units are named by core
+					if(!this->thread_cores.empty())
+					{
+						int thread_node = (device_idx < this->thread_cores.size() && this->thread_cores[device_idx] >= 0) ? core_numa_node(this->thread_cores[device_idx]) : -1;
+						cl_uint num_names = 0;
+
+						//cores on the node of this device's scheduler thread first
+						for(int pass = 0; pass < 2 && num_names < CPU_PARTITION_UNITS; pass++)
+						{
+							for(cl_uint unit = 0; unit < context[device_idx].device_max_compute_units && num_names < CPU_PARTITION_UNITS; unit++)
+							{
+								cl_bool pinned = CL_FALSE;
+								for(unsigned int t = 0; t < this->thread_cores.size(); t++)
+								{
+									if(this->thread_cores[t] == (int)unit)
+										pinned = CL_TRUE;
+								}
+								if(pinned || (pass == 0) != (thread_node < 0 || core_numa_node(unit) == thread_node))
+									continue;
+								partitionPrty[1 + num_names++] = unit;
+							}
+						}
+
+						if(num_names > 0)
+						{
+							partitionPrty[0] = CL_DEVICE_PARTITION_BY_NAMES_EXT;
+							partitionPrty[1 + num_names] = CL_PARTITION_BY_NAMES_LIST_END_EXT;
+							partitionPrty[2 + num_names] = CL_PROPERTIES_LIST_END_EXT;
+						}
+					}
+
+					// Initialize clCreateSubDevicesEXT function pointer
+					INIT_CL_EXT_FCN_PTR(this->context[device_idx].platform, clCreateSubDevicesEXT);
+
+					cl_uint numSubDevices = 0;
+					// Get number of sub-devices
+					status = pfn_clCreateSubDevicesEXT(context[device_idx].device, partitionPrty, 0, NULL, &numSubDevices);
+
+					if(cl_errChk(status, "checking number of sub devices in fission extensions", true))
+						exit(1);
+
+					printf("No of subdevice: %d\n", numSubDevices);
+
+					cl_device_id *subDevices= (cl_device_id*)malloc(numSubDevices * sizeof(cl_device_id));
+					if(NULL == subDevices)
+					{
+						printf("Failed to allocate memory(subDevices)\n");
+						exit(1);
+					}
+
+					status = pfn_clCreateSubDevicesEXT(context[device_idx].device, partitionPrty, numSubDevices,subDevices, NULL);
+					if(cl_errChk(status, "Creating sub devices using fission extensions", true))
+						exit(1);
+
+					/* Create sub device using OpenCL Fission, updated by Enqiang 07/25/2011*/
+					/*
+					cl_context_properties cps[3] = {CL_CONTEXT_PLATFORM, (cl_context_properties)(context[device_idx].platform), 0};
+					cl_context_properties *cprops = cps;
+					context[device_idx].context = clCreateContextFromType(cprops, (cl_device_type)(context[device_idx].dtype), NULL, NULL, &status);		
+					if(cl_errChk(status, "creating Context", true))
+						exit(1);
+
+					context[device_idx].command_queue = clCreateCommandQueue(context[device_idx].context, context[device_idx].device, CL_QUEUE_PROFILING_ENABLE | CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE, &status);
+					if(cl_errChk(status, "creating command queue", true))
+						exit(1);
+					*/
+
+					cl_context_properties cps[3] = {CL_CONTEXT_PLATFORM, (cl_context_properties)(context[device_idx].platform), 0};
+					cl_context_properties *cprops = cps;
+					context[device_idx].context = clCreateContext(cprops, numSubDevices, subDevices, NULL, NULL, &status);	
+					if(cl_errChk(status, "creating Context", true))
+						exit(1);
+					context[device_idx].command_queue = clCreateCommandQueue(context[device_idx].context, subDevices[0], CL_QUEUE_PROFILING_ENABLE | CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE, &status);
+					if(cl_errChk(status, "creating command queue", true))
+						exit(1);
+
+					context[device_idx].work_pool_context_idx = device_idx;
+					device_idx++;
+				}
+				else
+					perror("This Context Type Not Supported\n");
+
+			}						
+		}
+	}
+
+	return context;
+}
+
+//! Copy work unit information
+/*!
+Copy work unit information
+\param work_unit_from, The work unit which the information is copied FROM
+\param work_unit_to, The work unit which the information is copied TO
+\return
+*/
+void work_pool::work_units_copy(work_unit* work_unit_from, work_unit* work_unit_to)
+{
+	//if(work_unit_to->context_all == NULL)
+		//work_unit_to->context_all = (cl_context *)malloc(sizeof(cl_context)*this->total_num_devices);
+	//memcpy((void *)work_unit_to->context_all, (void *)work_unit_from->context_all, sizeof(cl_context)*this->total_num_devices);
+	work_unit_to->context = work_unit_from->context;
+	work_unit_to->dependency = work_unit_from->dependency;
+	work_unit_to->flags = work_unit_from->flags;
+	work_unit_to->global_work_offset = work_unit_from->global_work_offset;
+	work_unit_to->global_work_size = work_unit_from->global_work_size;
+	work_unit_to->kernel = work_unit_from->kernel;
+	work_unit_to->kernel_name= work_unit_from->kernel_name;
+	work_unit_to->local_work_size = work_unit_from->local_work_size;
+	work_unit_to->program = work_unit_from->program;
+	work_unit_to->program_with_path = work_unit_from->program_with_path;
+	work_unit_to->work_dim = work_unit_from->work_dim;
+	work_unit_to->work_unit_status = work_unit_from->work_unit_status;
+	//work_unit_to->kernel_index = work_unit_from->kernel_index;
+
+	return;
+}
+
+//! Create a lock-free ring
+/*!
+\param ring, The ring
+\param capacity, The number of pointers the ring holds, rounded up to a power of two
+\return CL_SUCCESS, or CL_OUT_OF_HOST_MEMORY
+*/
+cl_int work_pool_ring_init(work_pool_ring ring, cl_uint capacity)
+{
+	cl_uint size = 2;
+	while(size < capacity)
+		size <<= 1;
+
+	ring->cells = (_ring_cell *)malloc(sizeof(_ring_cell) * size);
+	if(ring->cells == NULL)
+		return CL_OUT_OF_HOST_MEMORY;
+
+	for(cl_uint i=0;i<size;i++)
+	{
+		ring->cells[i].sequence = i;
+		ring->cells[i].data = NULL;
+	}
+	ring->mask = size - 1;
+	ring->head = 0;
+	ring->tail = 0;
+
+	return CL_SUCCESS;
+}
+
+//! Push a pointer to a lock-free ring
+/*!
+\param ring, The ring
+\param data, The pointer
+\return CL_FALSE if the ring is full
+*/
+cl_bool work_pool_ring_push(work_pool_ring ring, void *data)
+{
+	_ring_cell *cell;
+	cl_uint position = ring->head;
+
+	while(1)
+	{
+		cell = &ring->cells[position & ring->mask];
+		cl_uint sequence = cell->sequence;
+		WP_MEMORY_BARRIER();
+		int difference = (int)(sequence - position);
+
+		if(difference == 0)
+		{
+			if(WP_ATOMIC_CAS(&ring->head, position, position + 1))
+				break;
+			position = ring->head;
+		}
+		else if(difference < 0)
+			return CL_FALSE;
+		else
+			position = ring->head;
+	}
+
+	cell->data = data;
+	//publish the data before the cell is marked full
+	WP_MEMORY_BARRIER();
+	cell->sequence = position + 1;
+
+	return CL_TRUE;
+}
+
+//! Pop a pointer from a lock-free ring
+/*!
+\param ring, The ring
+\return The oldest pointer, NULL if the ring is empty
+*/
+void* work_pool_ring_pop(work_pool_ring ring)
+{
+	_ring_cell *cell;
+	cl_uint position = ring->tail;
+
+	while(1)
+	{
+		cell = &ring->cells[position & ring->mask];
+		cl_uint sequence = cell->sequence;
+		WP_MEMORY_BARRIER();
+		int difference = (int)(sequence - (position + 1));
+
+		if(difference == 0)
+		{
+			if(WP_ATOMIC_CAS(&ring->tail, position, position + 1))
+				break;
+			position = ring->tail;
+		}
+		else if(difference < 0)
+			return NULL;
+		else
+			position = ring->tail;
+	}
+
+	void *data = cell->data;
+	//read the data before the cell is marked free for the next round
+	WP_MEMORY_BARRIER();
+	cell->sequence = position + ring->mask + 1;
+
+	return data;
+}
+
+//! Release a lock-free ring
+void work_pool_ring_release(work_pool_ring ring)
+{
+	free(ring->cells);
+	ring->cells = NULL;
+}
+
+//! Whether a dependency graph unit is taken before another
+/*!
+The earliest deadline first when the queue orders by deadline, then the
+longest remaining path, the higher priority level and the older work unit
+*/
+static cl_bool critical_before(work_pool_deque queue, work_unit *first, work_unit *second)
+{
+	if(queue->deadline_first && first->deadline != second->deadline)
+		return second->deadline == 0 || (first->deadline != 0 && first->deadline < second->deadline) ? CL_TRUE : CL_FALSE;
+	if(first->rank_key != second->rank_key)
+		return first->rank_key > second->rank_key ? CL_TRUE : CL_FALSE;
+	if(first->queue_level != second->queue_level)
+		return first->queue_level < second->queue_level ? CL_TRUE : CL_FALSE;
+
+	return first->unit_index < second->unit_index ? CL_TRUE : CL_FALSE;
+}
+
+//! The heap of a device queue a dependency graph unit belongs to
+static std::vector<work_unit *>& critical_heap(work_pool_deque queue, work_unit *work_unit_in)
+{
+	return work_unit_in->dag_device >= 0 ? queue->critical_bound : queue->critical;
+}
+
+//! Swap two work units of a heap and their positions
+static void critical_swap(std::vector<work_unit *> &heap, int i, int j)
+{
+	work_unit *moved = heap[i];
+	heap[i] = heap[j];
+	heap[j] = moved;
+	heap[i]->heap_index = i;
+	heap[j]->heap_index = j;
+}
+
+//! Move a work unit up its heap while it goes before its parent node
+static void critical_up(work_pool_deque queue, std::vector<work_unit *> &heap, int i)
+{
+	while(i > 0 && critical_before(queue, heap[i], heap[(i - 1) / 2]))
+	{
+		critical_swap(heap, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+//! Move a work unit down its heap while a child node goes before it
+static void critical_down(work_pool_deque queue, std::vector<work_unit *> &heap, int i)
+{
+	int size = heap.size();
+	for(;;)
+	{
+		int first = i;
+		if(2 * i + 1 < size && critical_before(queue, heap[2 * i + 1], heap[first]))
+			first = 2 * i + 1;
+		if(2 * i + 2 < size && critical_before(queue, heap[2 * i + 2], heap[first]))
+			first = 2 * i + 2;
+		if(first == i)
+			return;
+
+		critical_swap(heap, i, first);
+		i = first;
+	}
+}
+
+//! Append a work unit to its priority level of a device queue, the caller holds the queue lock
+static void queue_push(work_pool_deque queue, work_unit *work_unit_in)
+{
+	if(work_unit_in->ranked)
+	{
+		std::vector<work_unit *> &heap = critical_heap(queue, work_unit_in);
+		heap.push_back(work_unit_in);
+		work_unit_in->heap_index = heap.size() - 1;
+		critical_up(queue, heap, work_unit_in->heap_index);
+		return;
+	}
+
+	_priority_bucket *bucket = &queue->bucket[work_unit_in->queue_level];
+
+	work_unit_in->queue_prev = bucket->tail;
+	work_unit_in->queue_next = NULL;
+	if(bucket->tail != NULL)
+		bucket->tail->queue_next = work_unit_in;
+	else
+		bucket->head = work_unit_in;
+	bucket->tail = work_unit_in;
+
+	queue->priority_map[work_unit_in->queue_level / 32] |= 1u << (work_unit_in->queue_level % 32);
+}
+
+//! Unlink a work unit from a device queue, the caller holds the queue lock
+static void queue_remove(work_pool_deque queue, work_unit *work_unit_in)
+{
+	if(work_unit_in->ranked)
+	{
+		std::vector<work_unit *> &heap = critical_heap(queue, work_unit_in);
+		int i = work_unit_in->heap_index;
+		critical_swap(heap, i, heap.size() - 1);
+		heap.pop_back();
+		if(i < (int)heap.size())
+		{
+			work_unit *moved = heap[i];
+			critical_down(queue, heap, i);
+			critical_up(queue, heap, moved->heap_index);
+		}
+		work_unit_in->heap_index = -1;
+		return;
+	}
+
+	_priority_bucket *bucket = &queue->bucket[work_unit_in->queue_level];
+
+	if(work_unit_in->queue_prev != NULL)
+		work_unit_in->queue_prev->queue_next = work_unit_in->queue_next;
+	else
+		bucket->head = work_unit_in->queue_next;
+	if(work_unit_in->queue_next != NULL)
+		work_unit_in->queue_next->queue_prev = work_unit_in->queue_prev;
+	else
+		bucket->tail = work_unit_in->queue_prev;
+
+	if(bucket->head == NULL)
+		queue->priority_map[work_unit_in->queue_level / 32] &= ~(1u << (work_unit_in->queue_level % 32));
+}
+
+//! The first non-empty priority level of a device queue at or below level, -1 if there is none
+static int queue_next_level(work_pool_deque queue, int level)
+{
+	for(int word = level / 32; word < PRIORITY_WORDS; word++)
+	{
+		cl_uint bits = queue->priority_map[word];
+		if(word == level / 32)
+			bits &= ~0u << (level % 32);
+		if(bits != 0)
+			return word * 32 + WP_FIRST_SET(bits);
+	}
+
+	return -1;
+}
+
+//! Count a work unit taken from a device queue, and age the waiting ones every AGING_INTERVAL units
+static void queue_taken(work_pool_deque queue)
+{
+	WP_ATOMIC_ADD(&queue->num_units, -1);
+
+	if(++queue->starvation < AGING_INTERVAL)
+		return;
+	queue->starvation = 0;
+
+	//levels are visited upwards, so a moved unit is not moved twice
+	for(int level = queue_next_level(queue, 1); level > 0; level = queue_next_level(queue, level + 1))
+	{
+		work_unit *oldest = queue->bucket[level].head;
+		queue_remove(queue, oldest);
+		oldest->queue_level = level > AGING_STEP ? level - AGING_STEP : 0;
+		queue_push(queue, oldest);
+	}
+}
+
+//! Enqueue work unit to work pool
+/*!
+Enqueue work unit to the queue of the device chosen by the policy, wait for
+some space if the pool is full
+\param work_unit_in, The work unit which is enqueued
+\param priority, The priority of the work unit
+\param handle, If not NULL, receives a handle which resolves when the work unit completes
+\return status, Operation status
+*/
+void work_pool::enqueue(work_unit* work_unit_in, cl_uint priority, cl_int* status, work_unit_handle* handle)
+{
+	this->enqueue_units(&work_unit_in, &priority, 1, -1, status, handle, NULL);
+}
+
+//! Enqueue work unit to work pool with a deadline
+/*!
+The deadline orders the work unit when the policy is edf, and counts in
+num_missed_deadlines when the work unit completes after it
+\param work_unit_in, The work unit which is enqueued
+\param priority, The priority of the work unit
+\param deadline, Absolute completion deadline, cl_getTime plus a duration, 0 for none
+\param handle, If not NULL, receives a handle which resolves when the work unit completes
+\return status, Operation status
+*/
+void work_pool::enqueue(work_unit* work_unit_in, cl_uint priority, cl_time deadline, cl_int* status, work_unit_handle* handle)
+{
+	this->enqueue_units(&work_unit_in, &priority, 1, -1, status, handle, &deadline);
+}
+
+//! Enqueue work unit to work pool if there is space
+/*!
+\param work_unit_in, The work unit which is enqueued
+\param priority, The priority of the work unit
+\return status, CL_WORKPOOL_FULL if the pool is full and can not grow
+*/
+void work_pool::try_enqueue(work_unit* work_unit_in, cl_uint priority, cl_int* status, work_unit_handle* handle)
+{
+	this->enqueue_units(&work_unit_in, &priority, 1, 0, status, handle, NULL);
+}
+
+//! Enqueue work unit to work pool, waiting a limited time for space
+/*!
+\param work_unit_in, The work unit which is enqueued
+\param priority, The priority of the work unit
+\param timeout, The longest wait for space in ms
+\return status, CL_WORKPOOL_FULL if the pool stayed full
+*/
+void work_pool::enqueue_for(work_unit* work_unit_in, cl_uint priority, double timeout, cl_int* status, work_unit_handle* handle)
+{
+	this->enqueue_units(&work_unit_in, &priority, 1, timeout < 0 ? 0 : timeout, status, handle, NULL);
+}
+
+//! Enqueue several work units to work pool
+/*!
+Enqueue work units with one reservation of places in the pool and one wake
+up of the sleeping devices, as long as the batch fits in the pool
+\param work_units_in, The work units which are enqueued
+\param priorities, The priority of each work unit, NULL for the lowest priority
+\param num_units, The number of work units
+\param handles, If not NULL, receives a handle per work unit
+\return status, Operation status
+*/
+void work_pool::enqueue_batch(work_unit** work_units_in, const cl_uint* priorities, size_t num_units, cl_int* status, work_unit_handle* handles)
+{
+	this->enqueue_units(work_units_in, priorities, num_units, -1, status, handles, NULL);
+}
+
+//! Enqueue work units, waiting for space up to a timeout
+/*!
+\param work_units_in, The work units which are enqueued
+\param priorities, The priority of each work unit, NULL for the lowest priority
+\param num_units, The number of work units
+\param timeout, The longest wait for space in ms, 0 not to wait, negative to wait as long as it takes
+\param status, Operation status, CL_WORKPOOL_FULL if the wait timed out
+\param handles, If not NULL, receives a handle per enqueued work unit
+\param deadlines, The deadline of each work unit, NULL for none
+\return The number of work units enqueued, from the front of the batch
+*/
+size_t work_pool::enqueue_units(work_unit** work_units_in, const cl_uint* priorities, size_t num_units, double timeout, cl_int* status, work_unit_handle* handles, const cl_time* deadlines)
+{
+	//printf("[Enqueue]: In the work_pool_enqueue\n");
+#ifdef VERBOSE	
+	printf("@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@\n");
+	printf("@@@@@@ [Enqueue]:status at beginning of enqueue, num_work_units: %d, batch: %d\n", this->num_work_units, num_units);
+#endif
+
+	size_t num_enqueued = 0;
+	struct timeval deadline;
+
+	if(timeout > 0)
+	{
+		gettimeofday(&deadline, NULL);
+		long usec = deadline.tv_usec + (long)(timeout * 1000);
+		deadline.tv_sec += usec / 1000000;
+		deadline.tv_usec = usec % 1000000;
+	}
+
+	while(num_enqueued < num_units)
+	{
+		cl_uint num_reserved = this->reserve_places(num_units - num_enqueued, timeout, &deadline);
+		if(num_reserved == 0)
+		{
+#ifdef VERBOSE
+			printf("@@@@@@ [Enqueue]: Queue is still full, %d of %d work units enqueued\n", num_enqueued, num_units);
+#endif
+			set_status(status, CL_WORKPOOL_FULL);
+			return num_enqueued;
+		}
+
+		for(cl_uint i=0;i<num_reserved;i++)
+		{
+			cl_uint priority = priorities != NULL ? priorities[num_enqueued] : PRIORITY_LEVEL;
+
+			if(!this->submit(work_units_in[num_enqueued], priority, handles != NULL ? &handles[num_enqueued] : NULL, deadlines != NULL ? deadlines[num_enqueued] : 0))
+			{
+				//give back the places not used
+				WP_ATOMIC_ADD(&this->num_work_units, -(int)(num_reserved - i));
+				this->wake_devices();
+				set_status(status, CL_OUT_OF_HOST_MEMORY);
+				return num_enqueued;
+			}
+			num_enqueued++;
+		}
+
+		work_pool_state = WORK_POOL_NONEMPTY;
+
+		//once per batch, or per part of a batch larger than the pool
+		this->wake_devices();
+	}
+
+#ifdef PRINT_PROFILING	    
+	printf("[In Enqueue] queued work units per device: ");
+	for(unsigned int i=0;i<this->total_num_devices;i++)
+	{
+		printf("%d ", this->device_queue[i].num_units);
+	}
+	printf(" \n\n");
+#endif    
+
+#ifdef VERBOSE
+	printf("@@@@@@ [Enqueue]: after enqueue, num_work_units: %d\n", this->num_work_units);
+	printf("@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@\n");
+#endif
+
+	set_status(status, CL_SUCCESS);
+	return num_enqueued;
+}
+
+//! Reserve places in the pool for enqueued work units
+/*!
+Reserve as many places as are free, up to the number wanted. A full pool
+grows up to max_capacity, after that the caller waits for some space.
+\param num_wanted, The number of places wanted
+\param timeout, 0 not to wait, negative to wait as long as it takes, otherwise wait until deadline
+\param deadline, The end of the wait for a positive timeout
+\return The number of places reserved, 0 if the pool stayed full
+*/
+cl_uint work_pool::reserve_places(size_t num_wanted, double timeout, const struct timeval *deadline)
+{
+	while(1)
+	{
+		cl_uint num_work_units = this->num_work_units;
+		cl_uint capacity = this->capacity;
+
+		if(num_work_units >= capacity)
+		{
+			if(capacity < this->max_capacity)
+			{
+				cl_uint grown_capacity = capacity * 2 < this->max_capacity ? capacity * 2 : this->max_capacity;
+				if(WP_ATOMIC_CAS(&this->capacity, capacity, grown_capacity))
+				{
+#ifdef VERBOSE
+					printf("@@@@@@ [Enqueue]: Queue is full, grow it to %d work units\n", grown_capacity);
+#endif
+				}
+				continue;
+			}
+
+			if(timeout == 0)
+				return 0;
+
+#ifdef VERBOSE		
+			printf("@@@@@@ [Enqueue]: Queue is full, wait for some space \n");
+#endif
+			cl_bool timed_out = CL_FALSE;
+			struct timespec wake_time;
+			if(timeout > 0)
+			{
+				wake_time.tv_sec = deadline->tv_sec;
+				wake_time.tv_nsec = deadline->tv_usec * 1000;
+			}
+
+			pthread_mutex_lock (&this->work_unit_q_mutex);
+			work_pool_state = WORK_POOL_FULL;
+			while(this->num_work_units >= this->capacity && !timed_out)
+			{
+				if(timeout < 0)
+					pthread_cond_wait(&this->work_unit_q_full_cv, &this->work_unit_q_mutex);
+				else if(pthread_cond_timedwait(&this->work_unit_q_full_cv, &this->work_unit_q_mutex, &wake_time) == ETIMEDOUT)
+					timed_out = CL_TRUE;
+			}
+			pthread_mutex_unlock (&this->work_unit_q_mutex);
+
+			if(timed_out && this->num_work_units >= this->capacity)
+				return 0;
+			continue;
+		}
+
+		cl_uint num_reserved = capacity - num_work_units;
+		if(num_reserved > num_wanted)
+			num_reserved = (cl_uint)num_wanted;
+
+		if(WP_ATOMIC_CAS(&this->num_work_units, num_work_units, num_work_units + num_reserved))
+			return num_reserved;
+	}
+}
+
+//! Let the pool grow when it is full
+/*!
+A full pool doubles its capacity, up to max_capacity, instead of making the producers wait
+\param max_capacity, The largest capacity, the current capacity turns growth off
+*/
+void work_pool::set_max_capacity(cl_uint max_capacity)
+{
+	if(max_capacity < this->capacity)
+		max_capacity = this->capacity;
+
+	this->max_capacity = max_capacity;
+}
+
+//! Completion callback of a dependency event of a held work unit
+static void CL_CALLBACK dependency_event_callback(cl_event event, cl_int event_status, void* user_data)
+{
+	work_unit *work_unit_held = (work_unit *)user_data;
+
+	work_unit_held->pool->dependency_released(work_unit_held);
+}
+
+//! Hand a work unit to the device chosen by the policy
+/*!
+The caller has reserved a place in the pool for it
+\param work_unit_in, The work unit which is enqueued
+\param priority, The priority of the work unit
+\param handle, If not NULL, receives the handle of the work unit
+\param deadline, Absolute completion deadline, 0 for none
+\return CL_FALSE if the work unit could not be copied
+*/
+cl_bool work_pool::submit(work_unit* work_unit_in, cl_uint priority, work_unit_handle* handle, cl_time deadline)
+{
+	//pre-check the priority
+	if( priority > PRIORITY_LEVEL)
+	{
+#ifdef VERBOSE		
+		printf("@@@@@@ [Enqueue]: Priority is out of range, set to lowest \n");
+#endif
+		priority = PRIORITY_LEVEL;
+	}
+
+	//The work unit is copied, so the same work unit can be enqueued several times
+	work_unit *work_unit_copy = (work_unit *)malloc(sizeof(work_unit));
+	if(work_unit_copy == NULL)
+		return CL_FALSE;
+
+	memcpy(work_unit_copy, work_unit_in, sizeof(work_unit));
+	work_unit_copy->priority = priority;
+	work_unit_copy->unit_index = WP_ATOMIC_ADD(&this->work_unit_index, 1);
+	work_unit_copy->work_unit_status = CL_WORKUNIT_INITIALIZED;
+	work_unit_copy->estimated_time = 0;
+	work_unit_copy->kernel_time = 0;
+	work_unit_copy->split_parent = NULL;
+	work_unit_copy->split_groups = 0;
+	work_unit_copy->execution_status = CL_SUCCESS;
+	work_unit_copy->future = NULL;
+	if(handle != NULL)
+	{
+		work_unit_copy->future = new work_unit_future();
+		*handle = work_unit_copy->future;
+	}
+	work_unit_copy->pool = this;
+	work_unit_copy->queue_level = priority;
+	work_unit_copy->dag_device = -1;
+	work_unit_copy->deadline = deadline;
+	work_unit_copy->ranked = (work_unit_copy->future != NULL || work_unit_copy->num_parents != 0 || (deadline != 0 && this->deadline_first)) ? CL_TRUE : CL_FALSE;
+	work_unit_copy->own_cost = (work_unit_copy->ranked || this->num_streams != 0) ? this->estimate_cost(work_unit_copy) : 0;
+	work_unit_copy->stream_admitted = CL_FALSE;
+	if(work_unit_copy->future != NULL)
+		work_unit_copy->future->set_cost(work_unit_copy->own_cost, (work_unit_handle *)work_unit_in->parents, work_unit_copy->num_parents);
+
+	WP_ATOMIC_ADD(&this->num_pending_units, 1);
+
+	//the work unit is held until its dependency events complete as well, the device queues only hold ready units
+	cl_uint num_events = work_unit_copy->dependency != NULL ? work_unit_copy->dependency->num_events_in_wait_list : 0;
+
+	if(work_unit_copy->num_parents == 0 && num_events == 0)
+	{
+		work_unit_copy->parents = NULL;
+		this->make_ready(work_unit_copy);
+		return CL_TRUE;
+	}
+
+	work_unit_handle *parents = NULL;
+	if(work_unit_copy->num_parents != 0)
+	{
+		parents = (work_unit_handle *)malloc(sizeof(work_unit_handle) * work_unit_copy->num_parents);
+		memcpy(parents, work_unit_in->parents, sizeof(work_unit_handle) * work_unit_copy->num_parents);
+	}
+	work_unit_copy->parents = parents;
+
+	//one extra count, so the work unit is not released before all the parents know it
+	work_unit_copy->num_waiting_parents = work_unit_copy->num_parents + num_events + 1;
+	work_unit_copy->work_unit_status = CL_WORKUNIT_WAITING;
+	WP_ATOMIC_ADD(&this->num_held_units, 1);
+
+	for(unsigned int i=0;i<work_unit_copy->num_parents;i++)
+	{
+		parents[i]->retain();
+		parents[i]->raise_rank(work_unit_copy->own_cost);
+		if(parents[i]->add_child(work_unit_copy))
+			WP_ATOMIC_ADD(&work_unit_copy->num_waiting_parents, -1);
+	}
+
+	for(unsigned int i=0;i<num_events;i++)
+	{
+		if(clSetEventCallback(work_unit_copy->dependency->event_wait_list[i], CL_COMPLETE, dependency_event_callback, work_unit_copy) != CL_SUCCESS)
+			WP_ATOMIC_ADD(&work_unit_copy->num_waiting_parents, -1);
+	}
+
+#ifdef VERBOSE
+	printf("@@@@@@ [Enqueue]: Work unit no.%d waits for %d work units.\n", work_unit_copy->unit_index, work_unit_copy->num_parents);
+#endif
+
+	//the caller wakes the devices
+	if(WP_ATOMIC_ADD(&work_unit_copy->num_waiting_parents, -1) == 0)
+	{
+		WP_ATOMIC_ADD(&this->num_held_units, -1);
+		this->make_ready(work_unit_copy);
+	}
+
+	return CL_TRUE;
+}
+
+//! Queue a work unit whose parents have been issued or have completed
+/*!
+\param work_unit_in, The work unit, bound to a device if a parent was issued there
+*/
+void work_pool::make_ready(work_unit* work_unit_in)
+{
+	if(this->num_streams != 0 && !work_unit_in->stream_admitted)
+	{
+		this->stream_push(work_unit_in);
+		return;
+	}
+
+	int device_id = work_unit_in->dag_device;
+	if(device_id < 0)
+	{
+		device_id = this->policy->place(this, work_unit_in);
+		if(device_id < 0 || device_id >= (int)this->total_num_devices)
+			device_id = 0;
+	}
+	work_unit_in->home_device = device_id;
+	work_unit_in->work_unit_status = CL_WORKUNIT_INITIALIZED;
+
+	//a dependency graph unit is ordered by its rank, which grows with the children enqueued later
+	work_unit_in->heap_index = -1;
+	work_unit_in->rank_key = work_unit_in->own_cost;
+	if(work_unit_in->future != NULL)
+		work_unit_in->future->set_queued(work_unit_in);
+
+	//hand the work unit over without a lock, a device thread moves it to its queue
+	WP_ATOMIC_ADD(&this->device_queue[device_id].num_units, 1);
+	if(!work_pool_ring_push(&this->submit_ring, work_unit_in))
+	{
+		pthread_mutex_lock (&this->device_queue[device_id].lock);
+		queue_push(&this->device_queue[device_id], work_unit_in);
+		pthread_mutex_unlock (&this->device_queue[device_id].lock);
+	}
+	//a device about to sleep sees the change, or is woken by the caller
+	WP_ATOMIC_ADD(&this->ready_version, 1);
+
+#ifdef VERBOSE
+	printf("@@@@@@ [Enqueue]: Done processing work unit no.%d on device %d.\n", work_unit_in->unit_index, device_id);
+#endif
+}
+
+//! Create a submission stream
+/*!
+Work units are given to a stream with work_unit::set_stream. Once a stream
+exists, work units without one go through the default stream 0 of weight 1.
+\param name, The name of the stream, for the statistics printed by finish
+\param weight, The share of device time relative to the other streams, more than 0
+\param status, Operation status
+\return The stream, -1 on error
+*/
+cl_int work_pool::create_stream(const char* name, double weight, cl_int* status)
+{
+	if(weight <= 0)
+	{
+		set_status(status, CL_INVALID_VALUE);
+		return -1;
+	}
+
+	pthread_mutex_lock (&this->stream_mutex);
+	for(int i = this->streams.empty() ? 0 : 1; i < 2; i++)
+	{
+		work_pool_stream stream = (work_pool_stream)malloc(sizeof(_work_pool_stream));
+		if(stream == NULL)
+		{
+			pthread_mutex_unlock (&this->stream_mutex);
+			set_status(status, CL_OUT_OF_HOST_MEMORY);
+			return -1;
+		}
+
+		snprintf(stream->name, MAX_STREAM_NAME, "%s", i == 0 ? "default" : (name != NULL ? name : ""));
+		stream->weight = i == 0 ? 1.0 : weight;
+		stream->deficit = 0;
+		stream->head = NULL;
+		stream->tail = NULL;
+		stream->num_waiting = 0;
+		stream->num_completed = 0;
+		stream->device_time = 0;
+		this->streams.push_back(stream);
+	}
+	cl_int stream_id = this->streams.size() - 1;
+	WP_MEMORY_BARRIER();
+	this->num_streams = this->streams.size();
+	pthread_mutex_unlock (&this->stream_mutex);
+
+	set_status(status, CL_SUCCESS);
+	return stream_id;
+}
+
+//! Change the share of device time of a stream
+/*!
+\param stream, The stream, 0 for the default one
+\param weight, The share of device time relative to the other streams, more than 0
+\param status, Operation status
+*/
+void work_pool::set_stream_weight(cl_int stream, double weight, cl_int* status)
+{
+	pthread_mutex_lock (&this->stream_mutex);
+	if(weight <= 0 || stream < 0 || stream >= (cl_int)this->streams.size())
+	{
+		pthread_mutex_unlock (&this->stream_mutex);
+		set_status(status, CL_INVALID_VALUE);
+		return;
+	}
+	this->streams.at(stream)->weight = weight;
+	pthread_mutex_unlock (&this->stream_mutex);
+
+	set_status(status, CL_SUCCESS);
+}
+
+//! Hold a ready work unit in its stream until the round-robin lets it out
+void work_pool::stream_push(work_unit* work_unit_in)
+{
+	pthread_mutex_lock (&this->stream_mutex);
+	if(work_unit_in->stream < 0 || work_unit_in->stream >= (cl_int)this->streams.size())
+		work_unit_in->stream = 0;
+
+	work_pool_stream stream = this->streams.at(work_unit_in->stream);
+	work_unit_in->queue_prev = stream->tail;
+	work_unit_in->queue_next = NULL;
+	if(stream->tail != NULL)
+		stream->tail->queue_next = work_unit_in;
+	else
+		stream->head = work_unit_in;
+	stream->tail = work_unit_in;
+	stream->num_waiting++;
+	this->num_stream_waiting++;
+	WP_ATOMIC_ADD(&this->num_held_units, 1);
+	pthread_mutex_unlock (&this->stream_mutex);
+
+	this->stream_dispatch();
+}
+
+//! Let work units out of the streams by deficit round-robin
+/*!
+Keeps STREAM_DEPTH work units per device let out and not taken yet, so a
+burst in one stream waits in that stream instead of the device queues.
+Called when work units enter a stream and when devices take them.
+*/
+void work_pool::stream_dispatch()
+{
+	std::vector<work_unit *> admitted;
+
+	pthread_mutex_lock (&this->stream_mutex);
+	while(this->num_stream_waiting != 0 && this->num_stream_admitted < STREAM_DEPTH * this->total_num_devices)
+	{
+		work_pool_stream stream = this->streams.at(this->stream_turn);
+
+		if(stream->head == NULL)
+		{
+			//an idle stream saves no credit
+			stream->deficit = 0;
+			this->stream_turn = (this->stream_turn + 1) % this->streams.size();
+			this->stream_turn_given = CL_FALSE;
+			continue;
+		}
+
+		if(!this->stream_turn_given)
+		{
+			stream->deficit += stream->weight * STREAM_QUANTUM;
+			this->stream_turn_given = CL_TRUE;
+		}
+
+		work_unit *next = stream->head;
+		if(next->own_cost > stream->deficit)
+		{
+			this->stream_turn = (this->stream_turn + 1) % this->streams.size();
+			this->stream_turn_given = CL_FALSE;
+			continue;
+		}
+
+		stream->head = next->queue_next;
+		if(stream->head == NULL)
+			stream->tail = NULL;
+		else
+			stream->head->queue_prev = NULL;
+		stream->num_waiting--;
+		stream->deficit -= next->own_cost;
+		this->num_stream_waiting--;
+		WP_ATOMIC_ADD(&this->num_stream_admitted, 1);
+		next->stream_admitted = CL_TRUE;
+		admitted.push_back(next);
+	}
+	pthread_mutex_unlock (&this->stream_mutex);
+
+	if(admitted.empty())
+		return;
+
+	for(unsigned int i=0;i<admitted.size();i++)
+	{
+		WP_ATOMIC_ADD(&this->num_held_units, -1);
+		this->make_ready(admitted.at(i));
+	}
+	this->wake_devices();
+}
+
+//! A parent of a held work unit was issued or has completed
+/*!
+The work unit moves to the ready queues with its last parent
+\param work_unit_in, The held work unit
+*/
+void work_pool::dependency_released(work_unit* work_unit_in)
+{
+	if(WP_ATOMIC_ADD(&work_unit_in->num_waiting_parents, -1) != 0)
+		return;
+
+	WP_ATOMIC_ADD(&this->num_held_units, -1);
+	this->make_ready(work_unit_in);
+	this->wake_devices();
+}
+
+//! Wake up the sleeping devices, pairs with the check in acquire
+void work_pool::wake_devices()
+{
+	WP_MEMORY_BARRIER();
+	if(this->num_sleeping_devices != 0)
+	{
+		pthread_mutex_lock (&this->work_unit_q_mutex);
+		pthread_cond_broadcast(&this->work_unit_q_not_empty_cv);
+		pthread_mutex_unlock (&this->work_unit_q_mutex);
+	}
+}
+
+//! The queued dependency graph unit with the longest remaining path
+/*!
+The top of the heaps: ties go to the higher priority level, then to the
+older work unit. When the policy is earliest deadline first, the work units
+with a deadline come first, ordered by deadline. The caller holds the queue lock.
+\param queue, The device queue
+\param thief, The device stealing from the queue, -1 for the owner, units bound to the owner are not stolen
+\return The work unit, NULL if there is none
+*/
+work_unit* work_pool::critical_unit(work_pool_deque queue, int thief)
+{
+	work_unit *best = queue->critical.empty() ? NULL : queue->critical.front();
+	if(thief >= 0 || queue->critical_bound.empty())
+		return best;
+
+	work_unit *bound = queue->critical_bound.front();
+	if(best == NULL || critical_before(queue, bound, best))
+		return bound;
+
+	return best;
+}
+
+//! Move a queued dependency graph unit up its device queue as its rank grows
+/*!
+Called by the handle of the work unit with its lock held, before the unit is issued
+\param work_unit_in, The ready work unit
+\param rank, Its new upward rank
+*/
+void work_pool::rank_raised(work_unit* work_unit_in, double rank)
+{
+	work_pool_deque queue = &this->device_queue[work_unit_in->home_device];
+
+	pthread_mutex_lock (&queue->lock);
+	work_unit_in->rank_key = rank;
+	if(work_unit_in->heap_index >= 0)
+		critical_up(queue, critical_heap(queue, work_unit_in), work_unit_in->heap_index);
+	pthread_mutex_unlock (&queue->lock);
+}
+
+//! Estimated time of a work unit for ranking, kernel plus input transfer
+/*!
+\param work_unit_in, The work unit
+\return The policy's kernel estimate plus the array arguments at the mean transfer rate, in ms
+*/
+double work_pool::estimate_cost(work_unit* work_unit_in)
+{
+	double bytes = 0, rate = 0;
+
+	for(unsigned int arg_num=0; arg_num <work_unit_in->arguments.size(); arg_num++)
+	{
+		work_unit_arg arg = work_unit_in->arguments.at(arg_num);
+		if(arg->type == INT_ARRAY_TYPE || arg->type == FLOAT_ARRAY_TYPE)
+			bytes += arg->size;
+	}
+
+	for(unsigned int i=0;i<this->total_num_devices;i++)
+		rate += this->transfer_rate[i] / this->total_num_devices;
+
+	return this->policy->cost(this, work_unit_in) + (rate > 0 ? bytes / rate : 0);
+}
+
+//! Take a work unit from the device's own queue
+/*!
+Take the oldest ready work unit of the highest priority level which has one,
+or the dependency graph unit with the longest remaining path if its level is
+as high
+\param device_id, The device the queue belongs to
+\return The work unit, NULL if none is ready
+*/
+work_unit* work_pool::pop_local(int device_id)
+{
+	work_pool_deque queue = &this->device_queue[device_id];
+	work_unit *work_unit_ready = NULL;
+
+	if(queue->num_units == 0)
+		return NULL;
+
+	//queued work units are ready, their dependencies were waited for in submit
+	pthread_mutex_lock (&queue->lock);
+	int level = queue_next_level(queue, 0);
+	if(level >= 0)
+		work_unit_ready = queue->bucket[level].head;
+	work_unit *critical = this->critical_unit(queue, -1);
+	if(critical != NULL && (work_unit_ready == NULL || critical->queue_level <= work_unit_ready->queue_level || (this->deadline_first && critical->deadline != 0)))
+		work_unit_ready = critical;
+	if(work_unit_ready != NULL)
+	{
+		queue_remove(queue, work_unit_ready);
+		queue_taken(queue);
+	}
+	pthread_mutex_unlock (&queue->lock);
+
+	return work_unit_ready;
+}
+
+//! Steal a work unit from the busiest device
+/*!
+Take the newest ready work unit of the highest priority level from the longest queue of the other devices
+\param device_id, The device which is stealing
+\return The work unit, or NULL if no other device has a ready work unit
+*/
+work_unit* work_pool::steal(int device_id)
+{
+	int victim = -1;
+	cl_uint victim_units = 0;
+	work_unit *work_unit_ready = NULL;
+
+	for(unsigned int i=0;i<this->total_num_devices;i++)
+	{
+		if(i != (unsigned int)device_id && this->device_queue[i].num_units > victim_units)
+		{
+			victim = i;
+			victim_units = this->device_queue[i].num_units;
+		}
+	}
+
+	if(victim < 0)
+		return NULL;
+
+	work_pool_deque queue = &this->device_queue[victim];
+
+	pthread_mutex_lock (&queue->lock);
+	for(int level = queue_next_level(queue, 0); level >= 0 && work_unit_ready == NULL; level = queue_next_level(queue, level + 1))
+	{
+		for(work_unit *it = queue->bucket[level].tail; it != NULL; it = it->queue_prev)
+		{
+			//bound to the victim's command queue by the kernel event of a parent
+			if(it->dag_device >= 0)
+				continue;
+
+			work_unit_ready = it;
+			break;
+		}
+	}
+	work_unit *critical = this->critical_unit(queue, device_id);
+	if(critical != NULL && (work_unit_ready == NULL || critical->queue_level <= work_unit_ready->queue_level || (this->deadline_first && critical->deadline != 0)))
+		work_unit_ready = critical;
+	if(work_unit_ready != NULL)
+	{
+		queue_remove(queue, work_unit_ready);
+		queue_taken(queue);
+	}
+	pthread_mutex_unlock (&queue->lock);
+
+#ifdef VERBOSE
+	if(work_unit_ready != NULL)
+		printf("########### [Extract]: device %d stole work unit no.%d from device %d\n", device_id, work_unit_ready->unit_index, victim);
+#endif
+
+	return work_unit_ready;
+}
+
+//! Move the submitted work units to their device queues
+/*!
+Called by the device threads before they look for work
+*/
+void work_pool::drain_submissions()
+{
+	work_unit *work_unit_in;
+
+	while((work_unit_in = (work_unit *)work_pool_ring_pop(&this->submit_ring)) != NULL)
+	{
+		work_pool_deque queue = &this->device_queue[work_unit_in->home_device];
+
+		pthread_mutex_lock (&queue->lock);
+		queue_push(queue, work_unit_in);
+		pthread_mutex_unlock (&queue->lock);
+	}
+}
+
+//! Get the next work unit for a device
+/*!
+Get the next ready work unit from the device's own queue, or steal one
+from the busiest device. Sleep while there is nothing to take.
+\param device_id, The device asking for work
+\return The work unit, or NULL if the work pool is done
+*/
+work_unit* work_pool::acquire(int device_id)
+{
+	work_unit *work_unit_ready;
+
+	while(1)
+	{
+		//work units made ready after this point keep the device awake
+		cl_uint version = this->ready_version;
+		WP_MEMORY_BARRIER();
+
+		this->drain_submissions();
+
+		work_unit_ready = this->pop_local(device_id);
+
+		if(work_unit_ready == NULL && this->policy->steal(this, device_id))
+			work_unit_ready = this->steal(device_id);
+
+		if(work_unit_ready != NULL)
+			break;
+
+		pthread_mutex_lock (&this->work_unit_q_mutex);
+		this->num_sleeping_devices++;
+		//pairs with the barrier in wake_devices, so the wake up is not lost
+		WP_MEMORY_BARRIER();
+
+		if(this->done == 1 || this->num_active_splits != 0)
+		{
+			this->num_sleeping_devices--;
+			pthread_mutex_unlock (&this->work_unit_q_mutex);
+			return NULL;
+		}
+		else if(this->device_queue[device_id].num_units == 0 && this->ready_version == version)
+		{
+			//the work units left are held by their dependencies or bound to other devices
+#ifdef VERBOSE		
+			printf("########### [Extract]: device %d waits for the signal, queue is empty.\n", device_id);
+#endif
+			pthread_cond_wait(&this->work_unit_q_not_empty_cv, &this->work_unit_q_mutex);
+			this->num_sleeping_devices--;
+			pthread_mutex_unlock (&this->work_unit_q_mutex);
+		}
+		else
+		{
+			//a work unit became ready meanwhile, look again
+			this->num_sleeping_devices--;
+			pthread_mutex_unlock (&this->work_unit_q_mutex);
+		}
+	}
+
+	work_unit_ready->work_unit_status = CL_WORKUNIT_READY;
+
+	//make room for the next work unit of the streams
+	if(work_unit_ready->stream_admitted)
+	{
+		WP_ATOMIC_ADD(&this->num_stream_admitted, -1);
+		this->stream_dispatch();
+	}
+
+	cl_uint num_work_units = WP_ATOMIC_ADD(&this->num_work_units, -1);
+	if(num_work_units == 0)
+		work_pool_state = WORK_POOL_EMPTY;		
+	else
+		work_pool_state = WORK_POOL_NONEMPTY;			
+
+	if(num_work_units + 1 >= this->capacity)
+	{
+#ifdef VERBOSE
+		printf("########### [Extract]: Signal the work pool is not full anymore\n");
+#endif
+		pthread_mutex_lock (&this->work_unit_q_mutex);
+		pthread_cond_broadcast(&this->work_unit_q_full_cv);
+		pthread_mutex_unlock (&this->work_unit_q_mutex);
+	}
+
+	return work_unit_ready;
+}
+
+
+//! Dequeue work unit and distribute to device
+/*!
+Dequeue work unit and distribute to device
+\param context, The device context which the work unit is distributing to
+\param pfn_init_callback, The call back funtion to initilize kernel execution
+\param init_args, The arguments for the pfn_init_callback function
+\param pfn_finalize_callback, The call back funtion to finalize kernel execution
+\param finalize_args, The arguments for the pfn_finalize_callback function
+\param status, Operation status
+\return The index of the work unit distributed, 0 if the work pool is done
+*/
+cl_uint work_pool::extract_and_distribute(_work_pool_context context,  
+	void (*pfn_init_callback)(work_pool *, _work_pool_context, work_unit *, void*),	
+	void* init_args,							
+	void (*pfn_finalize_callback)(work_pool *, _work_pool_context, void*),	
+	void* finalize_args,
+	cl_int* status)
+{
+#ifdef VERBOSE
+	printf("#########################################################################\n");
+	printf("########### [Extract]: device %d, num_work_units: %d\n", context.work_pool_context_idx, this->num_work_units);
+#endif
+	work_unit *work_unit_ready = this->acquire(context.work_pool_context_idx);
+	if(work_unit_ready == NULL)
+		return 0;
+
+	//parents issued to this device are waited for in the command queue
+	std::vector<cl_event> wait_list;
+	for(unsigned int i=0;i<work_unit_ready->num_parents;i++)
+	{
+		cl_event parent_event = work_unit_ready->parents[i]->issued_event(context.work_pool_context_idx);
+		if(parent_event != NULL)
+			wait_list.push_back(parent_event);
+		work_unit_ready->parents[i]->release();
+	}
+	free((void *)work_unit_ready->parents);
+	work_unit_ready->parents = NULL;
+	work_unit_ready->num_parents = 0;
+	cl_uint num_parent_events = wait_list.size();
+
+#ifdef VERBOSE
+	printf("########### [Extract]: This ready work unit no.%d priority: %d\n", work_unit_ready->unit_index, work_unit_ready->priority);
+#endif
+
+	if((work_unit_ready->flags & CL_WORKUNIT_SPLIT) && this->total_num_devices > 1)
+	{
+		cl_uint split_index = this->split_and_distribute(work_unit_ready, context.work_pool_context_idx, status);
+		if(split_index != 0)
+		{
+			for(unsigned int i=0;i<num_parent_events;i++)
+				clReleaseEvent(wait_list.at(i));
+			return split_index;
+		}
+
+		//the NDRange can not be split, run the work unit whole
+	}
+
+
+	work_unit_ready->context = context.context;
+	work_unit_ready->program = work_unit_ready->program_all[context.work_pool_context_idx];
+	
+	//cl_kernel kernel = NULL;
+	work_unit_ready->kernel = work_unit_ready->kernel_all[context.work_pool_context_idx];
+
+
+	if(pfn_init_callback != NULL)
+		pfn_init_callback(this, context, work_unit_ready, init_args);
+
+	//TODO: set arguments
+	cl_int set_arg_status = 0;
+	cl_uint num_write_backs = 0;
+
+	for(unsigned int arg_num=0; arg_num <work_unit_ready->arguments.size(); arg_num++)
+	{
+		
+		if(work_unit_ready->arguments.at(arg_num)->type == INT_ARRAY_TYPE || work_unit_ready->arguments.at(arg_num)->type == FLOAT_ARRAY_TYPE)
+		{
+			cl_mem data_tmp;
+			data_tmp = this->request_buffer(context, work_unit_ready->arguments.at(arg_num)->arg_pointer, work_unit_ready->arguments.at(arg_num)->size, NULL, work_unit_ready->arguments.at(arg_num)->read_write_flag);
+			/*if(work_unit_ready->arguments.at(arg_num)->read_write_flag == 0)
+			{
+				data_tmp = this->request_buffer(context, work_unit_ready->arguments.at(arg_num)->arg_pointer, work_unit_ready->arguments.at(arg_num)->size, NULL, READ_ONLY);
+			}
+			else
+			{
+				data_tmp = this->request_buffer(context, work_unit_ready->arguments.at(arg_num)->arg_pointer, work_unit_ready->arguments.at(arg_num)->size, NULL, READ_WRITE);
+			}*/
+			//set_arg_status |= clEnqueueWriteBuffer(context.command_queue, data_tmp, CL_TRUE, 0, work_unit_ready->arguments.at(arg_num).size, work_unit_ready->arguments.at(arg_num).arg_pointer, 0, NULL, NULL);
+			//Added for testing by Enqiang
+			/*float *data_test_before = (float *)malloc(work_unit_ready->arguments.at(arg_num).size);
+			*status = clEnqueueReadBuffer(context.command_queue, data_tmp, CL_TRUE, 0, work_unit_ready->arguments.at(arg_num).size, (void *)data_test_before, 0, NULL, NULL);
+			//float *data = (float *)work_unit_ready->arguments.at(arg_num).arg_pointer;
+			printf("within data read back: data_test_before[1]: %f\n", data_test_before[1]);
+			*/
+			set_arg_status  |= clSetKernelArg(work_unit_ready->kernel, work_unit_ready->arguments.at(arg_num)->index, sizeof(cl_mem), (void *)&data_tmp); 
+
+			//order the kernel after the commands still using the buffer on this device
+			this->buffer_wait_list(work_unit_ready->arguments.at(arg_num)->arg_pointer, context.work_pool_context_idx, work_unit_ready->arguments.at(arg_num)->read_write_flag, wait_list);
+
+			if(work_unit_ready->arguments.at(arg_num)->read_write_flag == READ_WRITE)
+				num_write_backs++;
+		}
+		else if (work_unit_ready->arguments.at(arg_num)->type == INT_TYPE)
+		{
+			set_arg_status  |= clSetKernelArg(work_unit_ready->kernel, work_unit_ready->arguments.at(arg_num)->index, sizeof(int), (void *)&work_unit_ready->arguments.at(arg_num)->value_int); 
+		}			
+	}
+	cl_errChk(set_arg_status, "Error setting work unit args", true);
+
+	//cl_event event_test;
+
+	//event_test = clCreateUserEvent(context.context, status);	
+
+	cl_uint work_unit_total_index = work_unit_ready->unit_index;
+	if(work_unit_total_index <= this->total_unfinished_work_units)
+		cl_getTime(&this->unit_start_time[work_unit_total_index]);
+
+	//the unit completes after its kernel and all of its write-backs
+	work_unit_ready->pool = this;
+	work_unit_ready->device_id = context.work_pool_context_idx;
+	work_unit_ready->pending_events = 1 + num_write_backs;
+
+	pthread_mutex_lock (&this->inflight_mutex);
+	this->num_inflight[context.work_pool_context_idx]++;
+	pthread_mutex_unlock (&this->inflight_mutex);
+
+	//printf("[Extract]: executing kernel\n");
+	*status = clEnqueueNDRangeKernel(context.command_queue, 
+		work_unit_ready->kernel, 
+		work_unit_ready->work_dim, 
+		work_unit_ready->global_work_offset, 
+		work_unit_ready->global_work_size,
+		work_unit_ready->local_work_size, 
+		wait_list.size(),
+		wait_list.empty() ? NULL : &wait_list[0],
+		&work_unit_ready->kernel_event);
+	cl_errChk(*status, "Executing kernel", true);
+
+	for(unsigned int i=0;i<num_parent_events;i++)
+		clReleaseEvent(wait_list.at(i));
+
+	//children bound to this device can be queued now
+	if(work_unit_ready->future != NULL)
+		work_unit_ready->future->issue(context.work_pool_context_idx, work_unit_ready->kernel_event);
+
+	for(unsigned int arg_num=0; arg_num <work_unit_ready->arguments.size(); arg_num++)
+	{
+		if(work_unit_ready->arguments.at(arg_num)->type == INT_ARRAY_TYPE || work_unit_ready->arguments.at(arg_num)->type == FLOAT_ARRAY_TYPE)
+			this->buffer_record_event(work_unit_ready->arguments.at(arg_num)->arg_pointer, context.work_pool_context_idx, work_unit_ready->arguments.at(arg_num)->read_write_flag, work_unit_ready->kernel_event);
+	}
+
+	//printf("[Extract]: done executing kernel\n");
+	if(pfn_finalize_callback != NULL)
+		pfn_finalize_callback(this, context, finalize_args);
+
+	for(unsigned int arg_num=0; arg_num <work_unit_ready->arguments.size(); arg_num++)
+	{
+
+		if(work_unit_ready->arguments.at(arg_num)->read_write_flag == READ_WRITE)
+		{
+			cl_mem data_output = this->request_buffer(context, work_unit_ready->arguments.at(arg_num)->arg_pointer, work_unit_ready->arguments.at(arg_num)->size, NULL, CL_FALSE);
+			cl_event write_back_event = this->staged_write_back(context.work_pool_context_idx, data_output, 0, work_unit_ready->arguments.at(arg_num)->arg_pointer, work_unit_ready->arguments.at(arg_num)->size, work_unit_ready->kernel_event, status);
+
+			this->buffer_written_back(work_unit_ready->arguments.at(arg_num)->arg_pointer, work_unit_ready->arguments.at(arg_num)->size, context.work_pool_context_idx, write_back_event);
+
+			*status = clSetEventCallback(write_back_event, CL_COMPLETE, work_unit_event_callback, work_unit_ready);
+			cl_errChk(*status, "Setting write-back callback", true);
+		}						
+	}
+
+	cl_uint unit_index = work_unit_ready->unit_index;
+
+	//the callback may free the work unit at once
+	*status = clSetEventCallback(work_unit_ready->kernel_event, CL_COMPLETE, work_unit_event_callback, work_unit_ready);
+	cl_errChk(*status, "Setting kernel callback", true);
+
+	clFlush(context.command_queue);			
+
+#ifdef VERBOSE
+	printf("########### [Extract]: Finish execution of the work unit\n");
+#endif
+
+#ifdef PRINT_PROFILING	    
+	printf("[in Dequeue] queued work units per device: ");
+	for(unsigned int i=0;i<this->total_num_devices;i++)
+	{
+		printf("%d ", this->device_queue[i].num_units);
+	}
+	printf(" \n\n");
+#endif				
+
+	return unit_index;
+}
+
+
+static cl_event bridge_event(cl_event event, cl_context from, cl_context to);
+
+//! Start splitting a work unit across all devices
+/*!
+The NDRange is handed out along its last dimension in chunks of work
+groups, which every device thread takes in turn (guided self-scheduling).
+Array arguments are indexed by global id: inputs are uploaded whole, since
+a kernel may read outside its chunk, while output arrays only upload and
+read back the rows of the chunk, gathering the results into the host array.
+Modified device copies of the outputs are written back first, the chunks
+wait for split_ready rather than the scheduler thread. The work unit
+completes when every chunk and write-back has completed.
+\param work_unit_split, The work unit, taken from the queue of device_id
+\param device_id, The device whose scheduler thread takes the work unit
+\param status, Operation status
+\return The index of the work unit, 0 if its NDRange can not be split
+*/
+cl_uint work_pool::split_and_distribute(work_unit* work_unit_split, int device_id, cl_int* status)
+{
+	if(work_unit_split->work_dim == 0 || work_unit_split->work_dim > 3)
+		return 0;
+
+	cl_uint dim = work_unit_split->work_dim - 1;
+	size_t unit_offset = work_unit_split->global_work_offset != NULL ? work_unit_split->global_work_offset[dim] : 0;
+	size_t granularity = work_unit_split->local_work_size != NULL ? work_unit_split->local_work_size[dim] : 1;
+	size_t num_groups = work_unit_split->global_work_size[dim] / granularity;
+
+	if(num_groups < 2)
+		return 0;
+
+	//every array has to hold the same number of bytes per row of the last dimension
+	for(unsigned int arg_num=0; arg_num <work_unit_split->arguments.size(); arg_num++)
+	{
+		work_unit_arg arg = work_unit_split->arguments.at(arg_num);
+		if(arg->type != INT_ARRAY_TYPE && arg->type != FLOAT_ARRAY_TYPE)
+			continue;
+
+		if(arg->size % (unit_offset + work_unit_split->global_work_size[dim]) != 0)
+			return 0;
+	}
+
+#ifdef VERBOSE
+	printf("########### [Extract]: Split work unit no.%d into chunks of %d work groups\n", work_unit_split->unit_index, num_groups);
+#endif
+
+	//the chunks gather their rows into the host arrays of the outputs, after the results of earlier
+	//work units are written back; they wait for that in the command queues, this thread goes on
+	std::vector<cl_event> host_wait;
+	for(unsigned int arg_num=0; arg_num <work_unit_split->arguments.size(); arg_num++)
+	{
+		work_unit_arg arg = work_unit_split->arguments.at(arg_num);
+		if((arg->type == INT_ARRAY_TYPE || arg->type == FLOAT_ARRAY_TYPE) && arg->read_write_flag != READ_ONLY)
+			this->buffer_take_host(arg->arg_pointer, device_id, host_wait);
+	}
+
+	work_unit_split->split_ready = NULL;
+	if(!host_wait.empty())
+	{
+		*status = clEnqueueMarkerWithWaitList(this->context[device_id].command_queue, host_wait.size(), &host_wait[0], &work_unit_split->split_ready);
+		cl_errChk(*status, "Queueing the write-backs before a split work unit", true);
+		for(unsigned int k=0;k<host_wait.size();k++)
+			clReleaseEvent(host_wait.at(k));
+		clFlush(this->context[device_id].command_queue);
+	}
+
+	cl_uint unit_index = work_unit_split->unit_index;
+	if(unit_index <= this->total_unfinished_work_units)
+		cl_getTime(&this->unit_start_time[unit_index]);
+
+	//one pending event for handing out the chunks, each chunk adds one more
+	work_unit_split->pool = this;
+	work_unit_split->device_id = device_id;
+	work_unit_split->kernel_event = NULL;
+	work_unit_split->pending_events = 1;
+	work_unit_split->split_next = 0;
+	work_unit_split->split_groups = num_groups;
+
+	pthread_mutex_lock (&this->split_mutex);
+	this->active_splits.push_back(work_unit_split);
+	this->num_active_splits++;
+	pthread_mutex_unlock (&this->split_mutex);
+
+	//wake up the sleeping devices to help
+	pthread_mutex_lock (&this->work_unit_q_mutex);
+	pthread_cond_broadcast(&this->work_unit_q_not_empty_cv);
+	pthread_mutex_unlock (&this->work_unit_q_mutex);
+
+	this->run_split_chunk(device_id, status);
+
+	return unit_index;
+}
+
+//! Take the next chunk of a split work unit
+/*!
+The chunk is the device's split_weight share of the remaining work groups,
+divided by CHUNK_FACTOR and kept within the chunk bounds of the work unit
+\param device_id, The device the chunk runs on
+\param status, Operation status
+\return CL_TRUE if a chunk was issued to the device
+*/
+cl_bool work_pool::run_split_chunk(int device_id, cl_int* status)
+{
+	pthread_mutex_lock (&this->split_mutex);
+
+	if(this->active_splits.empty())
+	{
+		pthread_mutex_unlock (&this->split_mutex);
+		return CL_FALSE;
+	}
+
+	work_unit *work_unit_split = this->active_splits.front();
+	cl_uint dim = work_unit_split->work_dim - 1;
+	size_t granularity = work_unit_split->local_work_size != NULL ? work_unit_split->local_work_size[dim] : 1;
+	size_t remaining = work_unit_split->split_groups - work_unit_split->split_next;
+
+	double total_weight = 0;
+	for(unsigned int i=0;i<this->total_num_devices;i++)
+		total_weight += this->split_weight[i];
+
+	size_t chunk = (size_t)(remaining * this->split_weight[device_id] / (total_weight * CHUNK_FACTOR) + 0.5);
+	if(work_unit_split->max_chunk_size != 0 && chunk > work_unit_split->max_chunk_size / granularity)
+		chunk = work_unit_split->max_chunk_size / granularity;
+	if(chunk < work_unit_split->min_chunk_size / granularity)
+		chunk = work_unit_split->min_chunk_size / granularity;
+	if(chunk < 1)
+		chunk = 1;
+	if(chunk > remaining)
+		chunk = remaining;
+
+	size_t begin_group = work_unit_split->split_next;
+	work_unit_split->split_next += chunk;
+
+	//counted before the lock is released, so the work unit stays until the chunk completes
+	WP_ATOMIC_ADD(&work_unit_split->pending_events, 1);
+
+	cl_bool last_chunk = (work_unit_split->split_next == work_unit_split->split_groups);
+	if(last_chunk)
+	{
+		this->active_splits.erase(this->active_splits.begin());
+		this->num_active_splits--;
+	}
+
+	pthread_mutex_unlock (&this->split_mutex);
+
+	this->issue_chunk(work_unit_split, device_id, begin_group, begin_group + chunk, status);
+
+	//all chunks are handed out
+	if(last_chunk)
+		this->unit_complete(work_unit_split);
+
+	return CL_TRUE;
+}
+
+//! Issue a chunk of a split work unit to a device
+/*!
+\param work_unit_split, The split work unit
+\param device_id, The device the chunk runs on
+\param begin_group, The first work group of the chunk along the last dimension
+\param end_group, One past the last work group of the chunk
+\param status, Operation status
+*/
+void work_pool::issue_chunk(work_unit* work_unit_split, int device_id, size_t begin_group, size_t end_group, cl_int* status)
+{
+	cl_uint dim = work_unit_split->work_dim - 1;
+	size_t unit_offset = work_unit_split->global_work_offset != NULL ? work_unit_split->global_work_offset[dim] : 0;
+	size_t granularity = work_unit_split->local_work_size != NULL ? work_unit_split->local_work_size[dim] : 1;
+	size_t row_size = work_unit_split->global_work_size[dim];
+	size_t offset[3], size[3];
+	_work_pool_context chunk_context = this->context[device_id];
+	std::vector<cl_mem> chunk_buffers;
+	std::vector<cl_event> wait_list;
+	cl_uint num_outputs = 0;
+
+	for(unsigned int i=0;i<work_unit_split->work_dim;i++)
+	{
+		offset[i] = work_unit_split->global_work_offset != NULL ? work_unit_split->global_work_offset[i] : 0;
+		size[i] = work_unit_split->global_work_size[i];
+	}
+	offset[dim] = unit_offset + begin_group * granularity;
+	size[dim] = (end_group - begin_group) * granularity;
+
+	//the chunk completes on its own, then releases its place in the split work unit
+	work_unit *chunk = (work_unit *)malloc(sizeof(work_unit));
+	memcpy(chunk, work_unit_split, sizeof(work_unit));
+	chunk->split_parent = work_unit_split;
+	chunk->split_groups = 0;
+	chunk->device_id = device_id;
+	chunk->kernel_time = 0;
+
+	//a kernel object of its own, the device's thread may be setting the arguments of the shared one
+	cl_program program;
+	size_t name_size;
+	*status = clGetKernelInfo(work_unit_split->kernel_all[device_id], CL_KERNEL_PROGRAM, sizeof(cl_program), &program, NULL);
+	*status |= clGetKernelInfo(work_unit_split->kernel_all[device_id], CL_KERNEL_FUNCTION_NAME, 0, NULL, &name_size);
+	char *name = (char *)malloc(name_size);
+	*status |= clGetKernelInfo(work_unit_split->kernel_all[device_id], CL_KERNEL_FUNCTION_NAME, name_size, name, NULL);
+	cl_errChk(*status, "Querying kernel of split work unit", true);
+	cl_kernel kernel = clCreateKernel(program, name, status);
+	cl_errChk(*status, "Creating kernel of split work unit", true);
+	free(name);
+
+	//the outputs are written back before the chunk uses the host arrays
+	cl_event ready = NULL;
+	cl_bool host_ready = CL_TRUE;
+	if(work_unit_split->split_ready != NULL)
+	{
+		ready = bridge_event(work_unit_split->split_ready, this->context[work_unit_split->device_id].context, chunk_context.context);
+		wait_list.push_back(ready);
+
+		//the host arrays are staged on the host thread, only once the write-backs are done
+		cl_int execution_status;
+		if(clGetEventInfo(work_unit_split->split_ready, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int), &execution_status, NULL) != CL_SUCCESS
+			|| execution_status != CL_COMPLETE)
+			host_ready = CL_FALSE;
+	}
+
+	for(unsigned int arg_num=0; arg_num <chunk->arguments.size(); arg_num++)
+	{
+		work_unit_arg arg = chunk->arguments.at(arg_num);
+
+		if(arg->type == INT_ARRAY_TYPE || arg->type == FLOAT_ARRAY_TYPE)
+		{
+			size_t row_bytes = arg->size / (unit_offset + row_size);
+			cl_mem buffer;
+
+			if(arg->read_write_flag == READ_ONLY)
+			{
+				//inputs come from the buffer table, the chunks on a device share one upload
+				buffer = this->request_buffer(chunk_context, arg->arg_pointer, arg->size, NULL, READ_ONLY);
+				size_t first_wait = wait_list.size();
+				this->buffer_wait_list(arg->arg_pointer, device_id, READ_ONLY, wait_list);
+				for(unsigned int k=first_wait;k<wait_list.size();k++)
+					clRetainEvent(wait_list.at(k));
+			}
+			else
+			{
+				//the chunks on a device write their rows into the array's buffer, split_ready orders them after its earlier users
+				buffer = this->acquire_chunk_buffer(chunk_context, arg->arg_pointer, arg->size);
+				num_outputs++;
+
+				//the rows are uploaded through pinned memory, like the migrations
+				size_t rows_offset = offset[dim] * row_bytes;
+				size_t rows_size = arg->read_write_flag == READ_WRITE ? size[dim] * row_bytes : 0;
+				for(size_t piece=0;piece<rows_size;piece+=MIGRATION_CHUNK_SIZE)
+				{
+					size_t piece_size = rows_size - piece < (size_t)MIGRATION_CHUNK_SIZE ? rows_size - piece : MIGRATION_CHUNK_SIZE;
+					char *piece_data = (char *)arg->arg_pointer + rows_offset + piece;
+
+					staging_buffer staging = host_ready ? this->acquire_staging(device_id, piece_size) : NULL;
+					if(staging != NULL)
+						memcpy(staging->host_ptr, piece_data, piece_size);
+
+					cl_event upload_event;
+					*status = clEnqueueWriteBuffer(chunk_context.command_queue, buffer, CL_FALSE, rows_offset + piece, piece_size, staging != NULL ? staging->host_ptr : piece_data,
+						ready != NULL ? 1 : 0, ready != NULL ? &ready : NULL, &upload_event);
+					cl_errChk(*status, "Uploading chunk of output buffer", true);
+
+					if(staging != NULL)
+					{
+						*status = clSetEventCallback(upload_event, CL_COMPLETE, staged_write_callback, staging);
+						cl_errChk(*status, "Setting staging callback", true);
+					}
+					wait_list.push_back(upload_event);
+				}
+			}
+
+			*status = clSetKernelArg(kernel, arg->index, sizeof(cl_mem), (void *)&buffer);
+			cl_errChk(*status, "Setting chunk buffer arg", true);
+			if(arg->read_write_flag != READ_ONLY)
+				chunk_buffers.push_back(buffer);
+		}
+		else if (arg->type == INT_TYPE)
+		{
+			*status = clSetKernelArg(kernel, arg->index, sizeof(int), (void *)&arg->value_int);
+			cl_errChk(*status, "Setting chunk int arg", true);
+		}
+	}
+
+	chunk->pending_events = 1 + num_outputs;
+
+	pthread_mutex_lock (&this->inflight_mutex);
+	this->num_inflight[device_id]++;
+	pthread_mutex_unlock (&this->inflight_mutex);
+
+	*status = clEnqueueNDRangeKernel(chunk_context.command_queue, 
+		kernel, 
+		chunk->work_dim, 
+		offset, 
+		size,
+		chunk->local_work_size, 
+		wait_list.size(),
+		wait_list.empty() ? NULL : &wait_list[0],
+		&chunk->kernel_event);
+	cl_errChk(*status, "Executing kernel chunk", true);
+
+	for(unsigned int k=0;k<wait_list.size();k++)
+		clReleaseEvent(wait_list.at(k));
+
+	//gather the rows of the chunk into the host arrays
+	cl_uint buffer_num = 0;
+	for(unsigned int arg_num=0; arg_num <chunk->arguments.size(); arg_num++)
+	{
+		work_unit_arg arg = chunk->arguments.at(arg_num);
+		if(arg->type != INT_ARRAY_TYPE && arg->type != FLOAT_ARRAY_TYPE)
+			continue;
+
+		//the chunks write disjoint rows of an output, so they are recorded as readers: they do not
+		//wait for each other, and a later writer of the buffer waits for all of them
+		this->buffer_record_event(arg->arg_pointer, device_id, READ_ONLY, chunk->kernel_event);
+
+		if(arg->read_write_flag != READ_ONLY)
+		{
+			size_t row_bytes = arg->size / (unit_offset + row_size);
+			cl_event write_back_event = this->staged_write_back(device_id, chunk_buffers.at(buffer_num), offset[dim] * row_bytes,
+				(char *)arg->arg_pointer + offset[dim] * row_bytes, size[dim] * row_bytes, chunk->kernel_event, status);
+
+			this->buffer_record_event(arg->arg_pointer, device_id, READ_ONLY, write_back_event);
+
+			*status = clSetEventCallback(write_back_event, CL_COMPLETE, work_unit_event_callback, chunk);
+			cl_errChk(*status, "Setting chunk write-back callback", true);
+			buffer_num++;
+		}
+	}
+
+	clReleaseKernel(kernel);
+
+	//the callback may free the chunk at once
+	*status = clSetEventCallback(chunk->kernel_event, CL_COMPLETE, work_unit_event_callback, chunk);
+	cl_errChk(*status, "Setting chunk kernel callback", true);
+
+	clFlush(chunk_context.command_queue);
+}
+
+//! Set the share of split work units a device runs
+/*!
+\param device_id, The device
+\param weight, Relative size of the chunks of split work units the device takes
+*/
+void work_pool::set_split_weight(int device_id, double weight)
+{
+	if(device_id < 0 || device_id >= (int)this->total_num_devices || weight < 0)
+		return;
+
+	this->split_weight[device_id] = weight;
+}
+
+//! Init buffer table
+/*!
+Init buffer table
+\param buffer_table, The buffer table
+*/
+void work_pool::init_buffer_table(_buffer_table buffer_table)
+{
+	//printf("initialize buffer table\n");
+
+	this->buffer_table.num_devices = this->total_num_devices;
+	this->buffer_table.num_entries = 0;
+	//this->buffer_table.entry_list = NULL;
+	this->buffer_table.buckets.assign(BUFFER_TABLE_BUCKETS, (buffer_entry)NULL);
+
+	//a slice is only cut where every device can start a sub-buffer
+	this->buffer_table.sub_buffer_align = 1;
+	for(unsigned int i=0;i<this->total_num_devices;i++)
+	{
+		cl_uint align_bits = 0;
+		if(clGetDeviceInfo(this->context[i].device, CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(cl_uint), &align_bits, NULL) == CL_SUCCESS
+			&& align_bits / 8 > this->buffer_table.sub_buffer_align)
+			this->buffer_table.sub_buffer_align = align_bits / 8;
+	}
+
+	return;
+}
+
+//! Allocate a buffer table entry with no device buffer yet
+/*!
+\param data, The original host data pointer
+\param size, The size of the array
+\param num_devices, The number of devices
+\return The entry, not in the table yet
+*/
+static buffer_entry alloc_buffer_entry(void *data, cl_int size, cl_int num_devices)
+{
+	buffer_entry entry = (buffer_entry)malloc(sizeof(_buffer_entry));
+	entry->data = data;
+	entry->size = size;
+	entry->parent = NULL;
+	entry->offset = 0;
+	entry->num_devices = num_devices;
+	entry->pool_context = (work_pool_context)malloc(sizeof(_work_pool_context) * num_devices);
+	entry->buffer = (cl_mem *)malloc(sizeof(cl_mem) * num_devices);
+	entry->state = (int *)malloc(sizeof(int) * num_devices);
+	entry->write_event = (cl_event *)malloc(sizeof(cl_event) * num_devices);
+	entry->read_events = new std::vector<cl_event>[num_devices];
+	entry->host_write_event = NULL;
+	entry->host_write_device = -1;
+	entry->host_read_event = (cl_event *)malloc(sizeof(cl_event) * num_devices);
+	for(int i=0;i<num_devices;i++)
+	{
+		entry->buffer[i] = NULL;
+		entry->state[i] = BUFFER_INVALID;
+		entry->write_event[i] = NULL;
+		entry->host_read_event[i] = NULL;
+	}
+
+	return entry;
+}
+
+//! Free a buffer table entry from alloc_buffer_entry
+/*!
+Its buffers and events are released by the caller
+\param entry, The entry, out of the table
+*/
+static void free_buffer_entry(buffer_entry entry)
+{
+	free(entry->pool_context);
+	free(entry->buffer);
+	free(entry->state);
+	free(entry->write_event);
+	delete [] entry->read_events;
+	free(entry->host_read_event);
+	free(entry);
+}
+
+//! Completion callback of a command another context waits for
+/*!
+Completes the user event standing for the command in the other context
+*/
+static void CL_CALLBACK bridge_event_callback(cl_event event, cl_int event_status, void* user_data)
+{
+	cl_event user_event = (cl_event)user_data;
+
+	clSetUserEventStatus(user_event, event_status < 0 ? event_status : CL_COMPLETE);
+	clReleaseEvent(user_event);
+}
+
+//! Get an event of a context which completes with an event of another one
+/*!
+A wait list only takes events of the command queue's context, a command of
+one device waits for a command of another through a user event
+\param event, The event to wait for
+\param from, The context of the event
+\param to, The context of the command waiting
+\return The event to put in the wait list, released by the caller
+*/
+static cl_event bridge_event(cl_event event, cl_context from, cl_context to)
+{
+	if(from == to)
+	{
+		clRetainEvent(event);
+		return event;
+	}
+
+	cl_int status;
+	cl_event user_event = clCreateUserEvent(to, &status);
+	cl_errChk(status, "Creating bridge event", true);
+
+	//one reference for the caller, one for the callback
+	clRetainEvent(user_event);
+	status = clSetEventCallback(event, CL_COMPLETE, bridge_event_callback, user_event);
+	cl_errChk(status, "Setting bridge event callback", true);
+
+	return user_event;
+}
+
+//! A migration in flight, measured when its last command completes
+typedef struct {
+	work_pool *pool;
+	int device_id;
+	cl_int bytes;
+	cl_event first_event;
+} _transfer_record, *transfer_record;
+
+double total_transfer_time;
+
+//! Completion callback of the last command of a migration
+/*!
+Feed the device time of the whole migration to the transfer rate of the device
+*/
+static void CL_CALLBACK transfer_event_callback(cl_event event, cl_int event_status, void* user_data)
+{
+	transfer_record record = (transfer_record)user_data;
+	cl_ulong transfer_start, transfer_end;
+
+	if(event_status == CL_COMPLETE
+		&& clGetEventProfilingInfo(record->first_event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &transfer_start, NULL) == CL_SUCCESS
+		&& clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &transfer_end, NULL) == CL_SUCCESS
+		&& transfer_end > transfer_start)
+	{
+		double time = (transfer_end - transfer_start) / 1000000.0;
+		record->pool->record_transfer(record->device_id, record->bytes, time);
+	}
+
+	clReleaseEvent(record->first_event);
+	free(record);
+}
+
+//! Size class of a device buffer
+/*!
+\param size, The bytes needed
+\return The smallest power of two class holding size
+*/
+static int recycle_class(size_t size)
+{
+	int size_class = 0;
+	while(size_class < RECYCLE_CLASSES - 1 && ((size_t)RECYCLE_MIN_SIZE << size_class) < size)
+		size_class++;
+
+	return size_class;
+}
+
+//! Get a device buffer for an array
+/*!
+Reuse a buffer released by reset_buffer, or create one of the size class
+so it can be reused later. The caller holds buffer_table_mutex.
+\param context_requested, The device context
+\param size, The bytes needed
+\param status, Operation status
+\return The buffer, at least size bytes
+*/
+cl_mem work_pool::create_device_buffer(_work_pool_context context_requested, cl_int size, cl_int* status)
+{
+	int device_id = context_requested.work_pool_context_idx;
+	int size_class = recycle_class(size);
+	size_t class_size = (size_t)RECYCLE_MIN_SIZE << size_class;
+
+	//arrays above the largest class get a buffer of their own size
+	if(class_size < (size_t)size)
+		return clCreateBuffer(context_requested.context, CL_MEM_READ_WRITE, size, NULL, status);
+
+	std::vector<cl_mem> *free_list = &this->recycled_buffers[device_id * RECYCLE_CLASSES + size_class];
+	if(!free_list->empty())
+	{
+		cl_mem buffer = free_list->back();
+		free_list->pop_back();
+		this->recycled_bytes[device_id] -= class_size;
+		set_status(status, CL_SUCCESS);
+		return buffer;
+	}
+
+	return clCreateBuffer(context_requested.context, CL_MEM_READ_WRITE, class_size, NULL, status);
+}
+
+//! Keep a device buffer for the next frame
+/*!
+The caller holds buffer_table_mutex and no command uses the buffer any more
+\param device_id, The device of the buffer
+\param buffer, The buffer, from create_device_buffer
+*/
+void work_pool::recycle_device_buffer(int device_id, cl_mem buffer)
+{
+	size_t size = 0;
+	clGetMemObjectInfo(buffer, CL_MEM_SIZE, sizeof(size_t), &size, NULL);
+
+	int size_class = recycle_class(size);
+	size_t class_size = (size_t)RECYCLE_MIN_SIZE << size_class;
+	if(class_size != size || this->recycle_limit[device_id] == 0)
+	{
+		clReleaseMemObject(buffer);
+		return;
+	}
+
+	this->recycled_buffers[device_id * RECYCLE_CLASSES + size_class].push_back(buffer);
+	this->recycled_bytes[device_id] += class_size;
+}
+
+//! Release free device buffers down to a limit
+/*!
+The largest buffers go first. The caller holds buffer_table_mutex.
+\param device_id, The device
+\param limit, The bytes to keep
+*/
+void work_pool::trim_recycled(int device_id, cl_ulong limit)
+{
+	for(int size_class=RECYCLE_CLASSES-1;size_class>=0 && this->recycled_bytes[device_id] > limit;size_class--)
+	{
+		std::vector<cl_mem> *free_list = &this->recycled_buffers[device_id * RECYCLE_CLASSES + size_class];
+		while(!free_list->empty() && this->recycled_bytes[device_id] > limit)
+		{
+			clReleaseMemObject(free_list->back());
+			free_list->pop_back();
+			this->recycled_bytes[device_id] -= (size_t)RECYCLE_MIN_SIZE << size_class;
+		}
+	}
+}
+
+//! Buffer management
+/*!
+Buffer management across devices (platforms)
+\param context_requested, The device context which the requested buffer will be on
+\param data, The original host data pointer
+\param size, The size of the requested buffer
+\param desc, The description (currently unused)
+\param init, The flag which indicates if the requested buffer has to be initialized to a certain value
+*/
+double total_buffer_time;
+
+cl_mem work_pool::request_buffer(_work_pool_context context_requested, void *data, cl_int size, char* desc, cl_bool read_only_flag)
+{
+	//the buffer table is shared by all scheduler threads
+	pthread_mutex_lock (&this->buffer_table_mutex);
+	cl_mem buffer_found = this->acquire_buffer(context_requested, data, size, read_only_flag);
+	pthread_mutex_unlock (&this->buffer_table_mutex);
+
+	return buffer_found;
+}
+
+//! Get the current device buffer of a host array
+/*!
+The body of request_buffer, the caller holds buffer_table_mutex
+\param context_requested, The device context which the requested buffer will be on
+\param data, The original host data pointer
+\param size, The size of the requested buffer
+\param read_only_flag, READ_ONLY, WRITE_ONLY or READ_WRITE
+\return The buffer on the device
+*/
+cl_mem work_pool::acquire_buffer(_work_pool_context context_requested, void *data, cl_int size, cl_bool read_only_flag)
+{
+	cl_int device_id = context_requested.work_pool_context_idx;
+
+	cl_time begin_time, end_time;
+	cl_getTime(&begin_time);    
 
-					cl_context_properties cps[3] = {CL_CONTEXT_PLATFORM, (cl_context_properties)(context[device_idx].platform), 0};
-					cl_context_properties *cprops = cps;
-					context[device_idx].context = clCreateContext(cprops, numSubDevices, subDevices, NULL, NULL, &status);	
-					if(cl_errChk(status, "creating Context", true))
-						exit(1);
-					context[device_idx].command_queue = clCreateCommandQueue(context[device_idx].context, subDevices[0], CL_QUEUE_PROFILING_ENABLE | CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE, &status);
-					if(cl_errChk(status, "creating command queue", true))
-						exit(1);
+	buffer_entry entry = this->find_buffer_entry(data, size);
+	if(entry == NULL)
+		entry = this->slice_buffer_entry(data, size);
+	if(entry != NULL && entry->parent != NULL)
+		return this->acquire_slice(context_requested, entry, read_only_flag);
 
-					context[device_idx].work_pool_context_idx = device_idx;
-					device_idx++;
-				}
-				else
-					perror("This Context Type Not Supported\n");
+	//if the data is new to the buffer table
+	if(entry == NULL)
+	{
+		entry = alloc_buffer_entry(data, size, this->total_num_devices);
+		this->insert_buffer_entry(entry);
+	}
 
-			}						
+	//a kernel only writing the array needs no copy of it
+	if(entry->state[device_id] == BUFFER_INVALID && read_only_flag == WRITE_ONLY)
+	{
+		if(entry->buffer[device_id] == NULL)
+		{
+			cl_int status;
+			entry->buffer[device_id] = this->create_device_buffer(context_requested, entry->size, &status);
+			cl_errChk(status, "Error creating buffer", true);
+			entry->pool_context[device_id] = context_requested;
 		}
 	}
+	else if(entry->state[device_id] == BUFFER_INVALID)
+		this->fetch_buffer(context_requested, entry);
 
-	return context;
-}
+	//a writer keeps the only current copy
+	if(read_only_flag == WRITE_ONLY || read_only_flag == READ_WRITE)
+	{
+		for(unsigned int i=0;i<this->total_num_devices;i++)
+			entry->state[i] = BUFFER_INVALID;
+		entry->state[device_id] = BUFFER_MODIFIED;
+	}
 
-//! Copy work unit information
-/*!
-Copy work unit information
-\param work_unit_from, The work unit which the information is copied FROM
-\param work_unit_to, The work unit which the information is copied TO
-\return
-*/
-void work_pool::work_units_copy(work_unit* work_unit_from, work_unit* work_unit_to)
-{
-	//if(work_unit_to->context_all == NULL)
-		//work_unit_to->context_all = (cl_context *)malloc(sizeof(cl_context)*this->total_num_devices);
-	//memcpy((void *)work_unit_to->context_all, (void *)work_unit_from->context_all, sizeof(cl_context)*this->total_num_devices);
-	work_unit_to->context = work_unit_from->context;
-	work_unit_to->dependency = work_unit_from->dependency;
-	work_unit_to->flags = work_unit_from->flags;
-	work_unit_to->global_work_offset = work_unit_from->global_work_offset;
-	work_unit_to->global_work_size = work_unit_from->global_work_size;
-	work_unit_to->kernel = work_unit_from->kernel;
-	work_unit_to->kernel_name= work_unit_from->kernel_name;
-	work_unit_to->local_work_size = work_unit_from->local_work_size;
-	work_unit_to->program = work_unit_from->program;
-	work_unit_to->program_with_path = work_unit_from->program_with_path;
-	work_unit_to->work_dim = work_unit_from->work_dim;
-	work_unit_to->work_unit_status = work_unit_from->work_unit_status;
-	//work_unit_to->kernel_index = work_unit_from->kernel_index;
+	cl_getTime(&end_time);
+	total_buffer_time = total_buffer_time + cl_computeTime(begin_time, end_time);
 
-	return;
+	return entry->buffer[device_id];
 }
 
-//! Enqueue work unit to work pool
+//! Bring the copy of an array on a device up to date
 /*!
-Enqueue work unit to work pool
-\param work_unit_in, The work unit which is enqueued
-\return status, Operation status
+The copy comes from a device of the same context if one holds it, from a
+modified copy on another device through the host array, otherwise from the
+host array. The copy is queued, the commands using the buffer wait for its
+write_event. The device buffer is created on first use and kept for the
+life of the entry. The caller holds buffer_table_mutex.
+\param context_requested, The device context which needs the array
+\param entry, The buffer table entry of the array
 */
-void work_pool::enqueue(work_unit* work_unit_in, cl_uint priority, cl_int* status)
+void work_pool::fetch_buffer(_work_pool_context context_requested, buffer_entry entry)
 {
-	//printf("[Enqueue]: In the work_pool_enqueue\n");
-	//cl_uint work_unit_total_index = this->query();
-	//cl_getTime(&this->unit_start_time[work_unit_total_index]);
-	pthread_mutex_lock (&this->work_unit_q_mutex);
-#ifdef VERBOSE	
-	printf("@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@\n");
-	printf("@@@@@@ [Enqueue]:status at beginning of enqueue, num_work_units: %d, index_in: %d\n", this->num_work_units, this->index_in);
-#endif
-	
-	//pre-check the priority
-	if( priority > PRIORITY_LEVEL || priority < 0)
+	cl_int status;
+	cl_int device_id = context_requested.work_pool_context_idx;
+	int source = -1;
+	cl_bool cached = CL_FALSE;
+
+	if(entry->buffer[device_id] == NULL)
 	{
-#ifdef VERBOSE		
-		printf("@@@@@@ [Enqueue]: Priority is out of range, set to lowest \n");
-#endif
-		priority = PRIORITY_LEVEL;
+		entry->buffer[device_id] = this->create_device_buffer(context_requested, entry->size, &status);
+		cl_errChk(status, "Error creating buffer", true);
+		entry->pool_context[device_id] = context_requested;
 	}
-	this->work_unit_index ++;
 
-	if(this->num_work_units == WORKPOOL_CAP)
+	int owner = -1, neighbour = -1;
+	for(unsigned int i=0;i<this->total_num_devices;i++)
 	{
-#ifdef VERBOSE		
-		printf("@@@@@@ [Enqueue]: Queue is full, wait for some space \n");
-#endif
-		//printf("@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@\n");
-		pthread_cond_wait(&this->work_unit_q_full_cv, &this->work_unit_q_mutex);
+		if(entry->state[i] == BUFFER_INVALID)
+			continue;
+
+		cached = CL_TRUE;
+		if(entry->state[i] == BUFFER_MODIFIED)
+			owner = i;
+		if(neighbour < 0 && entry->pool_context[i].context == context_requested.context)
+			neighbour = i;
 	}
-	
-	if(this->num_work_units == 0)
+	source = neighbour >= 0 ? neighbour : owner;
+
+	this->transfer_buffer(entry, source, device_id);
+
+	for(unsigned int i=0;i<this->total_num_devices;i++)
 	{
-#ifdef VERBOSE		
-		//printf("@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@\n");
-		printf("@@@@@@ [Enqueue]: Queue is empty, num_work_units: %d,  index_in: %d\n", this->num_work_units, this->index_in);
-#endif
-		if(this->index_in != this->index_out)
-		{
-			printf("error happened\n");
-			exit(1);
-		}
-		
-		if(this->work_pool_start[this->index_in] == (work_unit *)0xcdcdcdcd)
-		{
-			this->work_pool_start[this->index_in] = (work_unit *)malloc(sizeof(work_unit));
-		}
-		//this->work_units_copy(work_unit_in, this->work_pool_start[this->index_in]);
-		memcpy(this->work_pool_start[this->index_in], work_unit_in, sizeof(work_unit));
-		this->work_pool_start[this->index_in]->priority = priority;
-		this->work_pool_start[this->index_in]->unit_index = this->work_unit_index;
-		
+		if(entry->state[i] == BUFFER_EXCLUSIVE)
+			entry->state[i] = BUFFER_SHARED;
+	}
+	//a modified copy copied within its context keeps the data the host array lacks
+	if(owner >= 0 && owner == source && neighbour < 0)
+		entry->state[owner] = BUFFER_SHARED;
+	entry->state[device_id] = cached ? BUFFER_SHARED : BUFFER_EXCLUSIVE;
+}
 
-		//copy the aug vector; this can not be done by memcpy
+//! Queue the copy of an array between devices or the host
+/*!
+Within one context the device buffers are copied directly. Otherwise the
+source is read into the host array and the destination written from it in
+MIGRATION_CHUNK_SIZE chunks, each write waiting for the read of its chunk,
+so the two directions overlap. Nothing blocks the calling thread. The
+caller holds buffer_table_mutex.
+\param entry, The buffer table entry of the array
+\param source, The device to copy from, -1 if the host array is current
+\param destination, The device to copy to, -1 to only write the host array
+*/
+void work_pool::transfer_buffer(buffer_entry entry, int source, int destination)
+{
+	cl_int status;
+	std::vector<cl_event> bridged;
+	std::vector<cl_event> read_wait, write_wait;
+	cl_event read_done = NULL, write_done = NULL, first_write = NULL;
+	cl_bool host_ready = source < 0;
+	_work_pool_context source_context, destination_context;
+
+	if(source >= 0)
+		source_context = entry->pool_context[source];
+	if(destination >= 0)
+	{
+		destination_context = entry->pool_context[destination];
 
-		//You have to include the work_unit class to the work_pool class so that you can only use the pointer
-		//But the work_unit will not be independent: same work unit can not be enqueued to different work pool
-		//this->work_pool_start[this->index_in] = work_unit_in;
+		//the destination buffer may still be used by commands queued before it went stale
+		if(entry->write_event[destination] != NULL)
+			write_wait.push_back(entry->write_event[destination]);
+		write_wait.insert(write_wait.end(), entry->read_events[destination].begin(), entry->read_events[destination].end());
+	}
 
-		if(this->index_in == max_size - 1)
-			this->index_in = 0;
-		else
-			this->index_in++;
+	if(source >= 0 && destination >= 0 && source_context.context == destination_context.context)
+	{
+		if(entry->write_event[source] != NULL)
+			write_wait.push_back(entry->write_event[source]);
 
-		this->num_work_units++;
-		
-		//printf("[Enqueue]: We have one unit in the pool\n");
-		work_pool_state = WORK_POOL_NONEMPTY;
+		status = clEnqueueCopyBuffer(destination_context.command_queue, entry->buffer[source], entry->buffer[destination], 0, 0, entry->size,
+			write_wait.size(), write_wait.empty() ? NULL : &write_wait[0], &write_done);
+		cl_errChk(status, "Error copying buffer between devices", true);
 
-		while(this->num_sleeping_devices != 0)
-		{
-			pthread_cond_signal(&this->work_unit_q_not_empty_cv);
-			this->num_sleeping_devices--;
-			//If the number of work units is less than number of active devices, break
-			//if(this->num_work_units <= this->total_num_devices - this->num_sleeping_devices)
-				//break;
-		}
-		
+		clRetainEvent(write_done);
+		entry->read_events[source].push_back(write_done);
+		clRetainEvent(write_done);
+		first_write = write_done;
 	}
-	
-	else if (this->num_work_units < max_size)
+	else
 	{
-#ifdef VERBOSE		
-		//printf("@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@\n");
-		printf("@@@@@@ [Enqueue]: Queue is not empty or full, num_work_units: %d,  index_in: %d\n", this->num_work_units, this->index_in);
-#endif
-		for(unsigned int enqueue_slot=this->num_work_units; enqueue_slot< max_size; enqueue_slot++)
+		if(source >= 0)
 		{
-			if(this->work_pool_start[this->index_in] == (work_unit *)0xcdcdcdcd)
-			{
-				this->work_pool_start[this->index_in] = (work_unit *)malloc(sizeof(work_unit));
-				break;
-			}
-			else if(this->work_pool_start[this->index_in]->work_unit_status == CL_WORKUNIT_WAITING)
-			{
-				if(this->index_in == max_size - 1)
-					this->index_in = 0;
-				else
-					this->index_in++;
-			}
-			else if(this->work_pool_start[this->index_in]->work_unit_status == CL_WORKUNIT_INITIALIZED)
+			//the host array is written, wait for the commands still using it
+			if(entry->write_event[source] != NULL)
+				read_wait.push_back(entry->write_event[source]);
+			for(unsigned int i=0;i<this->total_num_devices;i++)
 			{
-				if(this->index_in == max_size - 1)
-					this->index_in = 0;
-				else
-					this->index_in++;
+				if(entry->host_read_event[i] != NULL)
+					bridged.push_back(bridge_event(entry->host_read_event[i], entry->pool_context[i].context, source_context.context));
 			}
-			else if(this->work_pool_start[this->index_in]->work_unit_status == CL_WORKUNIT_COMPLETE)
+			if(entry->host_write_event != NULL)
+				bridged.push_back(bridge_event(entry->host_write_event, entry->pool_context[entry->host_write_device].context, source_context.context));
+			read_wait.insert(read_wait.end(), bridged.begin(), bridged.end());
+		}
+		else if(destination >= 0 && entry->host_write_event != NULL)
+		{
+			bridged.push_back(bridge_event(entry->host_write_event, entry->pool_context[entry->host_write_device].context, destination_context.context));
+			write_wait.push_back(bridged.back());
+
+			//the host array is staged on the host thread, only once nothing writes it
+			cl_int execution_status;
+			if(clGetEventInfo(entry->host_write_event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int), &execution_status, NULL) != CL_SUCCESS
+				|| execution_status != CL_COMPLETE)
+				host_ready = CL_FALSE;
+		}
+
+		for(cl_int offset=0;offset<entry->size;offset+=MIGRATION_CHUNK_SIZE)
+		{
+			cl_int chunk_size = entry->size - offset < MIGRATION_CHUNK_SIZE ? entry->size - offset : MIGRATION_CHUNK_SIZE;
+			char *chunk_data = (char *)entry->data + offset;
+
+			if(source >= 0)
 			{
-				break;
+				cl_event read_event;
+				status = clEnqueueReadBuffer(source_context.command_queue, entry->buffer[source], CL_FALSE, offset, chunk_size, chunk_data,
+					read_wait.size(), read_wait.empty() ? NULL : &read_wait[0], &read_event);
+				cl_errChk(status, "Error reading buffer to migrate", true);
+
+				//the chunks are read in order
+				if(read_done != NULL)
+					clReleaseEvent(read_done);
+				read_done = read_event;
+				read_wait.assign(1, read_done);
 			}
-			else
+
+			if(destination >= 0)
 			{
-				printf("Invalid work unit status, error!\n");
-				exit(-1);
-			}	
-		}
-		
-		memcpy(this->work_pool_start[this->index_in], work_unit_in, sizeof(work_unit));
-		this->work_pool_start[this->index_in]->priority = priority;
-		this->work_pool_start[this->index_in]->unit_index = this->work_unit_index;
-		//std::copy(work_unit_in->arguments.begin(), work_unit_in->arguments.end(), this->work_pool_start[this->index_in]->arguments.begin()); 
-		//this->work_pool_start[this->index_in]->arguments = work_unit_in->arguments;
-		//this->work_pool_start[this->index_in] = work_unit_in;
-#ifdef VERBOSE
-		printf("@@@@@@ [Enqueue]: Finish Enqueue operation\n");
-#endif
+				if(source >= 0)
+				{
+					bridged.push_back(bridge_event(read_done, source_context.context, destination_context.context));
+					write_wait.push_back(bridged.back());
+				}
 
-		if(this->index_in == max_size - 1)
-			this->index_in = 0;
-		else
-			this->index_in++;
-		
-		this->num_work_units++;
+				//uploads go through pinned memory
+				staging_buffer staging = host_ready ? this->acquire_staging(destination, chunk_size) : NULL;
+				if(staging != NULL)
+					memcpy(staging->host_ptr, chunk_data, chunk_size);
 
-		if(this->num_work_units == max_size)
-		{
-			//printf("[Enqueue]: Enqueue one unit successfully, and pool is full\n");
-			work_pool_state = WORK_POOL_FULL;
-		}
-		else
-		{
-			//printf("[Enqueue]: Enqueue one unit successfully\n");
-			work_pool_state = WORK_POOL_NONEMPTY;
+				cl_event write_event;
+				status = clEnqueueWriteBuffer(destination_context.command_queue, entry->buffer[destination], CL_FALSE, offset, chunk_size, staging != NULL ? staging->host_ptr : chunk_data,
+					write_wait.size(), write_wait.empty() ? NULL : &write_wait[0], &write_event);
+				cl_errChk(status, "Error copying data to buffer", true);
+
+				if(staging != NULL)
+				{
+					status = clSetEventCallback(write_event, CL_COMPLETE, staged_write_callback, staging);
+					cl_errChk(status, "Setting staging callback", true);
+				}
+
+				if(first_write == NULL)
+				{
+					clRetainEvent(write_event);
+					first_write = write_event;
+				}
+				if(write_done != NULL)
+					clReleaseEvent(write_done);
+				write_done = write_event;
+				write_wait.assign(1, write_done);
+			}
 		}
-	}
-	else if(this->num_work_units > max_size)
-	{
-#ifdef VERBOSE
-		printf("@@@@@@ [Enqueue]: Enqueue failed, queue is already full. Something is wrong.\n");
-#endif
-		work_pool_state = WORK_POOL_FAIL;
-		exit(-1);
-	}
-	
-	//work_pool_state = WORK_POOL_NONEMPTY;
-#ifdef PRINT_PROFILING	    
-	printf("[In Enqueue] index_out: %d, index_in: %d\n", index_out, index_in);
-	printf("[In Enqueue] work units status: \n");
-	for(int i=0;i<max_size;i++)
-	{
-		if(this->work_pool_start[i] != (work_unit *)0xcdcdcdcd)
+
+		if(read_done != NULL)
 		{
-			printf("%d ", this->work_pool_start[i]->work_unit_status);
+			clRetainEvent(read_done);
+			entry->read_events[source].push_back(read_done);
+
+			if(entry->host_write_event != NULL)
+				clReleaseEvent(entry->host_write_event);
+			entry->host_write_event = read_done;
+			entry->host_write_device = source;
 		}
-		else
+
+		if(write_done != NULL)
 		{
-			break;
+			clRetainEvent(write_done);
+			if(entry->host_read_event[destination] != NULL)
+				clReleaseEvent(entry->host_read_event[destination]);
+			entry->host_read_event[destination] = write_done;
 		}
 	}
-	printf(" \n\n");
-#endif    
 
-	//if(this->num_work_units == 1)
-	//pthread_cond_signal(&this->work_unit_q_not_empty_cv);
+	for(unsigned int k=0;k<bridged.size();k++)
+		clReleaseEvent(bridged.at(k));
 
-#ifdef VERBOSE
-	printf("@@@@@@ [Enqueue]: Done processing work unit no.%d.\n", this->work_unit_index);
-	printf("@@@@@@ [Enqueue]: after enqueue, num_work_units: %d, index_in: %d\n", this->num_work_units, this->index_in);
-	printf("@@@@@@ [Enqueue]: Release the lock.\n");
-	printf("@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@\n");
-#endif
+	if(source >= 0)
+		clFlush(source_context.command_queue);
+	if(write_done == NULL)
+		return;
+
+	//the copy is the last write of the destination buffer
+	if(entry->write_event[destination] != NULL)
+		clReleaseEvent(entry->write_event[destination]);
+	for(unsigned int k=0;k<entry->read_events[destination].size();k++)
+		clReleaseEvent(entry->read_events[destination].at(k));
+	entry->read_events[destination].clear();
+	entry->write_event[destination] = write_done;
+
+	transfer_record record = (transfer_record)malloc(sizeof(_transfer_record));
+	record->pool = this;
+	record->device_id = destination;
+	record->bytes = source >= 0 && source_context.context != destination_context.context ? 2 * entry->size : entry->size;
+	record->first_event = first_write;
+	status = clSetEventCallback(write_done, CL_COMPLETE, transfer_event_callback, record);
+	cl_errChk(status, "Setting transfer callback", true);
+
+	clFlush(destination_context.command_queue);
+}
 
-	//cl_uint work_unit_total_index = this->query();
-	//cl_getTime(&this->unit_start_time[work_unit_total_index]);
+//! Hash of a host pointer for the buffer table index
+static size_t buffer_hash(void *data)
+{
+	size_t hash = (size_t)data >> 4; //arrays are at least 16 byte aligned
+	hash ^= hash >> 17;
+	hash *= 0x9E3779B1u;
+	hash ^= hash >> 15;
 
-	pthread_mutex_unlock (&this->work_unit_q_mutex);
+	return hash;
+}
 
+//! Find the buffer table entry of a host array
+/*!
+Find the buffer table entry of a host array, the caller holds buffer_table_mutex
+\param data, The original host data pointer
+\param size, The size of the array, -1 for any size
+\return The entry, NULL if the array has no device buffer yet
+*/
+buffer_entry work_pool::find_buffer_entry(void *data, cl_int size)
+{
+	size_t bucket = buffer_hash(data) & (this->buffer_table.buckets.size() - 1);
 
+	for(buffer_entry entry = this->buffer_table.buckets[bucket]; entry != NULL; entry = entry->hash_next)
+	{
+		if(entry->data == data && (size < 0 || entry->size == size))
+			return entry;
+	}
+
+	return NULL;
 }
 
-//! Dequeue work unit and distribute to device
+//! Add an entry to the buffer table
 /*!
-Dequeue work unit and distribute to device
-\param context, The device context which the work unit is distributing to
-\param pfn_init_callback, The call back funtion to initilize kernel execution
-\param init_args, The arguments for the pfn_init_callback function
-\param pfn_finalize_callback, The call back funtion to finalize kernel execution
-\param finalize_args, The arguments for the pfn_finalize_callback function
-\param status, Operation status
+The index doubles when it holds more entries than buckets. The caller holds buffer_table_mutex.
+\param entry, The new entry
 */
-void work_pool::extract_and_distribute(_work_pool_context context,  
-	void (*pfn_init_callback)(work_pool *, _work_pool_context, work_unit *, void*),	
-	void* init_args,							
-	void (*pfn_finalize_callback)(work_pool *, _work_pool_context, void*),	
-	void* finalize_args,
-	cl_int* status)
+void work_pool::insert_buffer_entry(buffer_entry entry)
 {
-	pthread_mutex_lock (&this->work_unit_q_mutex);
-	//printf("[in Extract and Execute]: kernel index: %d\n", work_unit_ready->kernel_index);
-#ifdef VERBOSE
-	printf("#########################################################################\n");
-	printf("########### [Extract]: execute work unit at index: %d num_work_units: %d\n", this->index_out,  this->num_work_units);
-#endif
-	if(this->num_work_units == 0)
+	this->buffer_table.entry_list.push_back(entry);
+	this->buffer_table.num_entries++;
+
+	if(entry->parent == NULL)
+		this->index_array_entry(entry);
+
+	if((size_t)this->buffer_table.num_entries > this->buffer_table.buckets.size())
 	{
-#ifdef VERBOSE		
-		printf("########### [Extract]: wait for the signal, queue is empty.\n");
-		printf("#########################################################################\n");
-#endif
-		//work_pool_state = WORK_POOL_EMPTY;
-		if(this->done != 1)
+		std::vector<buffer_entry> buckets(this->buffer_table.buckets.size() * 2, (buffer_entry)NULL);
+		for(unsigned int j=0;j<this->buffer_table.entry_list.size();j++)
 		{
-			//pthread_mutex_lock (&this->work_unit_q_mutex);
-			this->num_sleeping_devices++;
-			pthread_cond_wait(&this->work_unit_q_not_empty_cv, &this->work_unit_q_mutex);
-			//pthread_mutex_unlock (&this->work_unit_q_mutex);
+			buffer_entry moved = this->buffer_table.entry_list.at(j);
+			size_t bucket = buffer_hash(moved->data) & (buckets.size() - 1);
+			moved->hash_next = buckets[bucket];
+			buckets[bucket] = moved;
 		}
-		
+		this->buffer_table.buckets.swap(buckets);
+		return;
 	}
-	
-	if(this->num_work_units > 0)
-	{
-#ifdef VERBOSE
-		printf("#########################################################################\n");
-		printf("########### [Extract]: Queue is not empty\n");
-#endif
-		//pthread_mutex_lock (&this->work_unit_q_mutex);
-		//work_unit *work_unit_ready = (work_unit *)malloc(sizeof(work_unit));
-		//Operations on the queue
-		
 
-		//check dependency and find the next available one
-		for(unsigned int m=0;m<this->num_work_units;m++)
-		{
-			//work_unit_ready = this->work_pool_start[this->index_out];
-			//memcpy(work_unit_ready, this->work_pool_start[this->index_out], sizeof(work_unit));
-			//work_unit_ready->priority = this->work_pool_start[this->index_out]->priority;
+	size_t bucket = buffer_hash(entry->data) & (this->buffer_table.buckets.size() - 1);
+	entry->hash_next = this->buffer_table.buckets[bucket];
+	this->buffer_table.buckets[bucket] = entry;
+}
 
-			if(this->work_pool_start[this->index_out]->work_unit_status == CL_WORKUNIT_INITIALIZED)
-			{
+//! Find the entry holding the device copies of a host array
+/*!
+A slice is kept coherent through its parent, so the parent is returned for it.
+A range with no entry of its own belongs to the outermost array enclosing it.
+The caller holds buffer_table_mutex.
+\param data, The original host data pointer
+\param size, The size of the array, -1 for any size
+\return The entry, NULL if no device holds the array
+*/
+buffer_entry work_pool::find_array_entry(void *data, cl_int size)
+{
+	buffer_entry entry = this->find_buffer_entry(data, size);
+	if(entry != NULL)
+		return entry->parent != NULL ? entry->parent : entry;
 
-				if(this->work_pool_start[this->index_out]->dependency != NULL && this->work_pool_start[this->index_out]->dependency->num_events_in_wait_list != 0)
-				{
-					printf("---------------------------------------------------------------------------------ever enter here?\n");
-					int dep_flag = 0;
-					for(unsigned int parents=0;parents<this->work_pool_start[this->index_out]->dependency->num_events_in_wait_list;parents++)
-					{
-						//get the event status of each one
-						cl_int event_status;
-						//clCreateUserEvent(context.context, status);
-						clGetEventInfo(this->work_pool_start[this->index_out]->dependency->event_wait_list[parents], CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int), &event_status, NULL);
-						if(event_status != CL_QUEUED)
-						{
-							dep_flag = 1;
-							break;
-						}
-					}
+	if(size < 0)
+		return NULL;
 
-					if(dep_flag == 0)
-					{
-						this->work_pool_start[this->index_out]->work_unit_status = CL_WORKUNIT_READY;
-						break;
-					}
-					else
-					{
-						this->work_pool_start[this->index_out]->work_unit_status = CL_WORKUNIT_WAITING;
+	//the indexed arrays do not nest, only the last one starting at or before the range can enclose it
+	std::map<char *, buffer_entry>::iterator it = this->buffer_table.arrays.upper_bound((char *)data);
+	if(it == this->buffer_table.arrays.begin())
+		return NULL;
+	--it;
 
-						if(this->index_out == max_size - 1)
-							this->index_out = 0;
-						else
-							this->index_out++;
-					}
-					
-				}
-				else
-				{
-					this->work_pool_start[this->index_out]->work_unit_status = CL_WORKUNIT_READY;
-					break;
-				}
-			}
-			else if(this->work_pool_start[this->index_out]->work_unit_status == CL_WORKUNIT_WAITING)
-			{
-				for(unsigned int parents=0;parents<this->work_pool_start[this->index_out]->dependency->num_events_in_wait_list;parents++)
-				{
-					//TODO: If work unit is waiting for a dependent work unit to finish
-					//get the event status of each one
-					//if all are done, work_unit_status = CL_WORKUNIT_READY, break;
-					//otherwise assign the work_unit_status = CL_WORKUNIT_WAITING, index_out++						
-				}
-			}
-			else if(this->work_pool_start[this->index_out]->work_unit_status == CL_WORKUNIT_COMPLETE)
-			{
-				if(this->work_pool_start[this->index_out]->dependency != NULL && this->work_pool_start[this->index_out]->dependency->num_events_in_wait_list != 0)
-				{
-					printf("---------------------------------------------------------------------------------ever enter here?\n");
-					int dep_flag = 0;
-					for(unsigned int parents=0;parents<this->work_pool_start[this->index_out]->dependency->num_events_in_wait_list;parents++)
-					{
-						//get the event status of each one
-						cl_int event_status;
-						//clCreateUserEvent(context.context, status);
-						clGetEventInfo(this->work_pool_start[this->index_out]->dependency->event_wait_list[parents], CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int), &event_status, NULL);
-						if(event_status != CL_QUEUED)
-						{
-							dep_flag = 1;
-							break;
-						}
-					}
+	buffer_entry enclosing = it->second;
+	if((char *)data + size > (char *)enclosing->data + enclosing->size)
+		return NULL;
 
-					if(dep_flag == 0)
-					{
-						this->work_pool_start[this->index_out]->work_unit_status = CL_WORKUNIT_READY;
-						break;
-					}
-					else
-					{
-						this->work_pool_start[this->index_out]->work_unit_status = CL_WORKUNIT_WAITING;
+	return enclosing;
+}
 
-						if(this->index_out == max_size - 1)
-							this->index_out = 0;
-						else
-							this->index_out++;
-					}
-					
-				}
-				else
-				{
-					this->work_pool_start[this->index_out]->work_unit_status = CL_WORKUNIT_READY;
-					break;
-				}							
-			}
-			else
-			{
-				printf("########### Invalid work unit status, error!\n");
-				exit(-1);
-			}					
-			
-		}
-		//pthread_mutex_unlock (&this->work_unit_q_mutex);
+//! Index an array of the buffer table by its start address
+/*!
+An array inside an indexed one is left out, and the indexed arrays inside a
+new one leave the index, so the indexed ranges never nest. The caller holds
+buffer_table_mutex.
+\param entry, The new entry of a whole array
+*/
+void work_pool::index_array_entry(buffer_entry entry)
+{
+	std::map<char *, buffer_entry> &arrays = this->buffer_table.arrays;
+	char *start = (char *)entry->data;
+	char *end = start + entry->size;
 
-		if(this->work_pool_start[this->index_out]->work_unit_status == CL_WORKUNIT_READY)
-		{
-			//pthread_mutex_lock (&this->work_unit_q_mutex);
-#ifdef VERBOSE
-			printf("########### [Extract]: Found the ready work unit, dequeue!\n");
-#endif
-			work_unit *work_unit_ready = (work_unit *)malloc(sizeof(work_unit));
-			memcpy(work_unit_ready, this->work_pool_start[this->index_out], sizeof(work_unit));
-			work_unit_ready->priority = this->work_pool_start[this->index_out]->priority;
-			this->work_pool_start[this->index_out]->work_unit_status = CL_WORKUNIT_COMPLETE;
-#ifdef VERBOSE
-			printf("########### [Extract]: This ready work unit no.%d priority: %d\n", work_unit_ready->unit_index, work_unit_ready->priority);
-#endif
+	std::map<char *, buffer_entry>::iterator next = arrays.upper_bound(start);
+	if(next != arrays.begin())
+	{
+		std::map<char *, buffer_entry>::iterator previous = next;
+		--previous;
+		if((char *)previous->second->data + previous->second->size >= end)
+			return;
+		if(previous->first == start)
+			arrays.erase(previous);
+	}
 
-			if(this->index_out == max_size - 1)
-				this->index_out = 0;
-			else
-				this->index_out++;			
+	while(next != arrays.end() && (char *)next->second->data + next->second->size <= end)
+		arrays.erase(next++);
 
-			if(this->num_work_units == WORKPOOL_CAP)
-			{
-#ifdef VERBOSE
-				printf("########### [Extract]: Signal the work pool is not full anymore\n");
-#endif
-				pthread_cond_signal(&this->work_unit_q_full_cv);
-			}
+	arrays[start] = entry;
+}
+
+//! Add a slice of an array already in the buffer table
+/*!
+The caller holds buffer_table_mutex
+\param data, The first byte of the slice
+\param size, The size of the slice
+\return The slice entry, NULL if no array encloses the range or the devices cannot start a sub-buffer at it
+*/
+buffer_entry work_pool::slice_buffer_entry(void *data, cl_int size)
+{
+	buffer_entry parent = this->find_array_entry(data, size);
+	if(parent == NULL || (parent->data == data && parent->size == size))
+		return NULL;
 
-			this->num_work_units--;
+	size_t offset = (char *)data - (char *)parent->data;
+	if(offset % this->buffer_table.sub_buffer_align != 0)
+		return NULL;
 
-			if(this->num_work_units == 0)
-				work_pool_state = WORK_POOL_EMPTY;		
-			else
-				work_pool_state = WORK_POOL_NONEMPTY;			
+	buffer_entry slice = alloc_buffer_entry(data, size, this->total_num_devices);
+	slice->parent = parent;
+	slice->offset = offset;
+	this->insert_buffer_entry(slice);
 
 #ifdef VERBOSE
-			printf("########### [Extract]: index operations finished\n");
-			printf("########### [Extract]: after extract: index_out: %d, num_work_units: %d\n", this->index_out,  this->num_work_units);
+	printf("@@@@@@ [Buffer]: %d bytes at offset %lu become a slice of a %d byte array\n", size, (unsigned long)offset, parent->size);
 #endif
-			
-			//pthread_mutex_unlock (&this->work_unit_q_mutex);
 
-			work_unit_ready->context = context.context;
-			work_unit_ready->program = work_unit_ready->program_all[context.work_pool_context_idx];
-			
-			//cl_kernel kernel = NULL;
-			work_unit_ready->kernel = work_unit_ready->kernel_all[context.work_pool_context_idx];
+	return slice;
+}
 
+//! Cut the sub-buffer of a slice out of its parent's buffer on a device, once
+/*!
+The caller holds buffer_table_mutex
+\param context_requested, The device context
+\param slice, The slice entry
+\param parent_buffer, The parent's buffer on the device
+\return The sub-buffer
+*/
+static cl_mem slice_sub_buffer(_work_pool_context context_requested, buffer_entry slice, cl_mem parent_buffer)
+{
+	cl_int status;
+	cl_int device_id = context_requested.work_pool_context_idx;
 
-			if(pfn_init_callback != NULL)
-				pfn_init_callback(this, context, work_unit_ready, init_args);
+	if(slice->buffer[device_id] == NULL)
+	{
+		//the access flags of a sub-buffer may not exceed the parent's
+		cl_mem_flags parent_flags;
+		status = clGetMemObjectInfo(parent_buffer, CL_MEM_FLAGS, sizeof(cl_mem_flags), &parent_flags, NULL);
+		cl_errChk(status, "Querying flags of parent buffer", true);
+
+		cl_buffer_region region;
+		region.origin = slice->offset;
+		region.size = slice->size;
+		slice->buffer[device_id] = clCreateSubBuffer(parent_buffer, parent_flags & (CL_MEM_READ_WRITE | CL_MEM_WRITE_ONLY | CL_MEM_READ_ONLY),
+			CL_BUFFER_CREATE_TYPE_REGION, &region, &status);
+		cl_errChk(status, "Creating sub-buffer of slice", true);
+		slice->pool_context[device_id] = context_requested;
+	}
 
-			//TODO: set arguments
-			cl_int set_arg_status = 0;
+	return slice->buffer[device_id];
+}
 
-			for(unsigned int arg_num=0; arg_num <work_unit_ready->arguments.size(); arg_num++)
-			{
-				
-				if(work_unit_ready->arguments.at(arg_num)->type == INT_ARRAY_TYPE || work_unit_ready->arguments.at(arg_num)->type == FLOAT_ARRAY_TYPE)
-				{
-					cl_mem data_tmp;
-					data_tmp = this->request_buffer(context, work_unit_ready->arguments.at(arg_num)->arg_pointer, work_unit_ready->arguments.at(arg_num)->size, NULL, work_unit_ready->arguments.at(arg_num)->read_write_flag);
-					/*if(work_unit_ready->arguments.at(arg_num)->read_write_flag == 0)
-					{
-						data_tmp = this->request_buffer(context, work_unit_ready->arguments.at(arg_num)->arg_pointer, work_unit_ready->arguments.at(arg_num)->size, NULL, READ_ONLY);
-					}
-					else
-					{
-						data_tmp = this->request_buffer(context, work_unit_ready->arguments.at(arg_num)->arg_pointer, work_unit_ready->arguments.at(arg_num)->size, NULL, READ_WRITE);
-					}*/
-					//set_arg_status |= clEnqueueWriteBuffer(context.command_queue, data_tmp, CL_TRUE, 0, work_unit_ready->arguments.at(arg_num).size, work_unit_ready->arguments.at(arg_num).arg_pointer, 0, NULL, NULL);
-					//Added for testing by Enqiang
-					/*float *data_test_before = (float *)malloc(work_unit_ready->arguments.at(arg_num).size);
-					*status = clEnqueueReadBuffer(context.command_queue, data_tmp, CL_TRUE, 0, work_unit_ready->arguments.at(arg_num).size, (void *)data_test_before, 0, NULL, NULL);
-					//float *data = (float *)work_unit_ready->arguments.at(arg_num).arg_pointer;
-					printf("within data read back: data_test_before[1]: %f\n", data_test_before[1]);
-					*/
-					set_arg_status  |= clSetKernelArg(work_unit_ready->kernel, work_unit_ready->arguments.at(arg_num)->index, sizeof(cl_mem), (void *)&data_tmp); 
-				}
-				else if (work_unit_ready->arguments.at(arg_num)->type == INT_TYPE)
-				{
-					set_arg_status  |= clSetKernelArg(work_unit_ready->kernel, work_unit_ready->arguments.at(arg_num)->index, sizeof(int), (void *)&work_unit_ready->arguments.at(arg_num)->value_int); 
-				}			
-			}
-			cl_errChk(set_arg_status, "Error setting work unit args", true);
-
-			//cl_event event_test;
-
-			//event_test = clCreateUserEvent(context.context, status);	
-
-			cl_uint work_unit_total_index = this->query();
-			cl_getTime(&this->unit_start_time[work_unit_total_index]);
-
-			//printf("[Extract]: executing kernel\n");
-			*status = clEnqueueNDRangeKernel(context.command_queue, 
-				work_unit_ready->kernel, 
-				work_unit_ready->work_dim, 
-				work_unit_ready->global_work_offset, 
-				work_unit_ready->global_work_size,
-				work_unit_ready->local_work_size, 
-				0,
-				NULL,
-				NULL);
-			cl_errChk(*status, "Executing kernel", true);
-			//clFinish(context.command_queue);
-			//cl_uint work_unit_total_index = this->query();
-			//cl_getTime(&this->unit_start_time[work_unit_total_index]);
-
-			clFlush(context.command_queue);			
-
-			//cl_int event_status;
-			//clGetEventInfo(*work_unit_ready->dependency->event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int), &event_status, NULL);
-
-			/*if(event_status == CL_COMPLETE)
-				printf("------event_status: %d, CL_COMPLETE\n", event_status);
-			else if(event_status == CL_RUNNING)
-				printf("------event_status: %d, CL_RUNNING\n", event_status);
-			else if(event_status == CL_SUBMITTED)
-				printf("------event_status: %d, CL_SUBMITTED\n", event_status);
-			else if(event_status == CL_QUEUED)
-				printf("------event_status: %d, CL_QUEUED\n", event_status);*/
-
-			//printf("[Extract]: done executing kernel\n");
-				if(pfn_finalize_callback != NULL)
-					pfn_finalize_callback(this, context, finalize_args);
-
-			//pthread_mutex_lock (&this->work_unit_q_mutex);
-				for(unsigned int arg_num=0; arg_num <work_unit_ready->arguments.size(); arg_num++)
-				{
+//! Get the device buffer of a slice
+/*!
+Bring the parent array up to date on the device, then cut the slice out of
+the parent's buffer once per device. The caller holds buffer_table_mutex.
+\param context_requested, The device context which the requested buffer will be on
+\param slice, The slice entry
+\param read_only_flag, READ_ONLY, WRITE_ONLY or READ_WRITE
+\return The sub-buffer on the device
+*/
+cl_mem work_pool::acquire_slice(_work_pool_context context_requested, buffer_entry slice, cl_bool read_only_flag)
+{
+	buffer_entry parent = slice->parent;
 
-					if(work_unit_ready->arguments.at(arg_num)->read_write_flag == READ_WRITE)
-					{
-						cl_mem data_output = this->request_buffer(context, work_unit_ready->arguments.at(arg_num)->arg_pointer, work_unit_ready->arguments.at(arg_num)->size, NULL, CL_FALSE);
-					//float *data_test = (float *)malloc(work_unit_ready->arguments.at(0).size);
-						*status = clEnqueueReadBuffer(context.command_queue, data_output, CL_FALSE, 0, work_unit_ready->arguments.at(arg_num)->size, work_unit_ready->arguments.at(arg_num)->arg_pointer, 0, NULL, NULL);
-					//float *data = (float *)work_unit_ready->arguments.at(arg_num).arg_pointer;
-					//printf("within data read back: data_test[1]: %f\n", data_test[1]);
-						cl_errChk(*status, "Reading output from buffer", true);
-					}						
-				}
+	//the rest of the array is kept, so a writer of the slice still needs the copy
+	cl_mem parent_buffer = this->acquire_buffer(context_requested, parent->data, parent->size, read_only_flag == WRITE_ONLY ? READ_WRITE : read_only_flag);
 
+	return slice_sub_buffer(context_requested, slice, parent_buffer);
+}
 
-			}
+//! Get the device buffer the chunks of a split work unit write an output to
+/*!
+All the chunks on a device share the array's buffer in the buffer table,
+or a sub-buffer of it for a slice. The copy is not fetched and stays
+BUFFER_INVALID, since it only holds the rows of the chunks run on the
+device; it goes back to the free lists with the entry in reset_buffer.
+\param context_requested, The device context the chunk runs on
+\param data, The original host data pointer
+\param size, The size of the array
+\return The buffer on the device
+*/
+cl_mem work_pool::acquire_chunk_buffer(_work_pool_context context_requested, void *data, cl_int size)
+{
+	cl_int status;
+	cl_int device_id = context_requested.work_pool_context_idx;
 
+	pthread_mutex_lock (&this->buffer_table_mutex);
 
-#ifdef VERBOSE
-			printf("########### [Extract]: Finish execution of the work unit\n");
-#endif
-		//pthread_mutex_lock (&this->work_unit_q_mutex);
+	buffer_entry entry = this->find_buffer_entry(data, size);
+	if(entry == NULL)
+		entry = this->slice_buffer_entry(data, size);
+	if(entry == NULL)
+	{
+		entry = alloc_buffer_entry(data, size, this->total_num_devices);
+		this->insert_buffer_entry(entry);
+	}
 
-#ifdef PRINT_PROFILING	    
-			printf("[in Dequeue] work units status: \n");
-			for(int i=0;i<WORKPOOL_CAP;i++)
-			{
-				if(this->work_pool_start[i] != (work_unit *)0xcdcdcdcd)
-				{
-					printf("%d ", this->work_pool_start[i]->work_unit_status);
-				}
-				else
-				{
-					break;
-				}
-			}
-			printf(" \n\n");
-#endif				
+	buffer_entry array = entry->parent != NULL ? entry->parent : entry;
+	if(array->buffer[device_id] == NULL)
+	{
+		array->buffer[device_id] = this->create_device_buffer(context_requested, array->size, &status);
+		cl_errChk(status, "Creating chunk output buffer", true);
+		array->pool_context[device_id] = context_requested;
+	}
+	array->state[device_id] = BUFFER_INVALID;
 
-		}
+	cl_mem buffer = entry != array ? slice_sub_buffer(context_requested, entry, array->buffer[device_id]) : array->buffer[device_id];
 
-#ifdef VERBOSE
-		printf("########### [Extract]: Exit extraction, and realease the lock\n");
-		printf("#########################################################################\n");
-#endif
-		pthread_mutex_unlock (&this->work_unit_q_mutex);
+	pthread_mutex_unlock (&this->buffer_table_mutex);
 
-	}
+	return buffer;
+}
 
-//! Init buffer table
+//! Collect the events a command using a buffer has to wait for
 /*!
-Init buffer table
-\param buffer_table, The buffer table
+A reader waits for the last writer of the buffer on the device, a writer
+also waits for the readers since that write
+\param data, The original host data pointer
+\param device_id, The device the command is queued on
+\param flag, READ_ONLY for a reader, WRITE_ONLY or READ_WRITE for a writer
+\param wait_list, The events are appended to this list
 */
-void work_pool::init_buffer_table(_buffer_table buffer_table)
+void work_pool::buffer_wait_list(void *data, int device_id, cl_int flag, std::vector<cl_event> &wait_list)
 {
-	//printf("initialize buffer table\n");
+	pthread_mutex_lock (&this->buffer_table_mutex);
 
-	this->buffer_table.num_devices = this->total_num_devices;
-	this->buffer_table.num_entries = 0;
-	//this->buffer_table.entry_list = NULL;
+	buffer_entry entry = this->find_array_entry(data);
+	if(entry != NULL)
+	{
+		if(entry->write_event[device_id] != NULL)
+			wait_list.push_back(entry->write_event[device_id]);
 
-	return;
+		if(flag != READ_ONLY)
+			wait_list.insert(wait_list.end(), entry->read_events[device_id].begin(), entry->read_events[device_id].end());
+	}
+
+	pthread_mutex_unlock (&this->buffer_table_mutex);
 }
 
-//! Buffer management
+//! Record a command using a buffer
 /*!
-Buffer management across devices (platforms)
-\param context_requested, The device context which the requested buffer will be on
+Record a command using a buffer, so later commands can be ordered after it
 \param data, The original host data pointer
-\param size, The size of the requested buffer
-\param desc, The description (currently unused)
-\param init, The flag which indicates if the requested buffer has to be initialized to a certain value
+\param device_id, The device the command is queued on
+\param flag, READ_ONLY for a reader, WRITE_ONLY or READ_WRITE for a writer
+\param event, The event of the command
 */
-double total_buffer_time;
-double total_transfer_time;
-
-cl_mem work_pool::request_buffer(_work_pool_context context_requested, void *data, cl_int size, char* desc, cl_bool read_only_flag)
+void work_pool::buffer_record_event(void *data, int device_id, cl_int flag, cl_event event)
 {
-	cl_int status;
-	buffer_entry entry;
+	pthread_mutex_lock (&this->buffer_table_mutex);
 
-	cl_time begin_time, end_time;
-	cl_time begin_transfer_time, end_transfer_time;
-	cl_getTime(&begin_time);    
+	buffer_entry entry = this->find_array_entry(data);
+	if(entry != NULL)
+	{
+		clRetainEvent(event);
+
+		if(flag == READ_ONLY)
+		{
+			entry->read_events[device_id].push_back(event);
+		}
+		else
+		{
+			if(entry->write_event[device_id] != NULL)
+				clReleaseEvent(entry->write_event[device_id]);
+			for(unsigned int k=0;k<entry->read_events[device_id].size();k++)
+				clReleaseEvent(entry->read_events[device_id].at(k));
+			entry->read_events[device_id].clear();
+
+			entry->write_event[device_id] = event;
+		}
+	}
+
+	pthread_mutex_unlock (&this->buffer_table_mutex);
+}
+
+//! Record the write-back of a modified copy into the host array
+/*!
+The write-back reads the device buffer. Once it covers the whole array, the
+host array is current again: the copy is demoted to BUFFER_EXCLUSIVE and the
+later copies from the host array are ordered after the write-back.
+\param data, The original host data pointer
+\param size, The size of the written back array
+\param device_id, The device the modified copy is on
+\param event, The event of the write-back
+*/
+void work_pool::buffer_written_back(void *data, cl_int size, int device_id, cl_event event)
+{
+	pthread_mutex_lock (&this->buffer_table_mutex);
 
-	for(unsigned int j=0;j<buffer_table.entry_list.size();j++)
+	buffer_entry entry = this->find_array_entry(data, size);
+	if(entry != NULL)
 	{
-		buffer_entry entry_lookup = buffer_table.entry_list.at(j);
-		if(entry_lookup->data == (int)data)
+		clRetainEvent(event);
+		entry->read_events[device_id].push_back(event);
+
+		if(entry->data == data && entry->size == size && entry->state[device_id] == BUFFER_MODIFIED)
 		{
-			//data is already in the vector
-			
-			if(entry_lookup->valid_idx == context_requested.work_pool_context_idx)
-			{
-				cl_getTime(&end_time);
-				total_buffer_time = total_buffer_time + cl_computeTime(begin_time, end_time);
-                //printf("Buffer management(existing) time for this frame: %f\n", cl_computeTime(begin_time, end_time));
-				return entry_lookup->buffer[entry_lookup->valid_idx];
-			}
-			else   //Not tested yet
-			{
-				if(entry_lookup->coherent_flag[context_requested.work_pool_context_idx] == READ_ONLY)
-				{
-					entry_lookup->valid_idx = context_requested.work_pool_context_idx;
-					return entry_lookup->buffer[context_requested.work_pool_context_idx];
-				}
+			clRetainEvent(event);
+			if(entry->host_write_event != NULL)
+				clReleaseEvent(entry->host_write_event);
+			entry->host_write_event = event;
+			entry->host_write_device = device_id;
+			entry->state[device_id] = BUFFER_EXCLUSIVE;
+		}
+	}
 
-				if(entry_lookup->coherent_flag[context_requested.work_pool_context_idx] == WRITE_ONLY)
-				{
-					entry_lookup->valid_idx = context_requested.work_pool_context_idx;
-					return entry_lookup->buffer[context_requested.work_pool_context_idx];
-				}
+	pthread_mutex_unlock (&this->buffer_table_mutex);
+}
 
-				cl_getTime(&begin_transfer_time);
-                //copy buffer through CPU data pointer
-				char *data_for_copy = (char *)malloc(sizeof(char)*size);
-				status = clEnqueueReadBuffer(entry_lookup->pool_context[entry_lookup->valid_idx].command_queue, entry_lookup->buffer[entry_lookup->valid_idx], CL_TRUE, 0, 
-					size, data_for_copy, 0, NULL, NULL); 
-				if(status != CL_SUCCESS) {
-					printf("error copying data to buffer\n");
-					exit(-1);
-				}
-				
-				entry_lookup->valid_idx = context_requested.work_pool_context_idx;
-
-				entry_lookup->pool_context[entry_lookup->valid_idx] = context_requested;
-                //if(entry_lookup->buffer[entry_lookup->valid_idx] == NULL)
-                //{
-				entry_lookup->buffer[entry_lookup->valid_idx] = clCreateBuffer(context_requested.context, CL_MEM_READ_WRITE, size, NULL, &status);		
-				if(status != CL_SUCCESS) {
-					printf("error creating buffer\n");
-					exit(-1);
-				}
-                //}
+//! Record the duration of a host to device transfer
+/*!
+Keep a smoothed transfer rate per device, used to estimate the cost of moving data.
+Called from the completion callbacks of the migrations, so it runs under inflight_mutex.
+\param device_id, The device the data was transferred to
+\param size, The number of bytes transferred
+\param time, The duration of the transfer in ms
+*/
+void work_pool::record_transfer(int device_id, cl_int size, double time)
+{
+	if(time <= 0 || size <= 0)
+		return;
 
-				status = clEnqueueWriteBuffer(context_requested.command_queue, entry_lookup->buffer[entry_lookup->valid_idx], CL_TRUE, 0, 
-					size, data_for_copy, 0, NULL, NULL); 
-				if(status != CL_SUCCESS) {
-					printf("error copying data to buffer\n");
-					exit(-1);
-				}
+	double rate = size / time;
+
+	pthread_mutex_lock (&this->inflight_mutex);
+	total_transfer_time = total_transfer_time + time;
+	this->transfer_rate[device_id] = TRANSFER_RATE_SMOOTHING * rate + (1 - TRANSFER_RATE_SMOOTHING) * this->transfer_rate[device_id];
+	pthread_mutex_unlock (&this->inflight_mutex);
+}
+
+//! Bytes of an array argument to move to a device
+/*!
+Mirrors fetch_buffer: a modified copy on another device is written back to
+the host and uploaded again, so it counts twice. A slice moves with the
+whole array it belongs to.
+\param entry, The buffer table entry of the array, NULL if not in the table yet
+\param size, The size of the array
+\param device_id, The device the array is needed on
+\param num_devices, The number of devices
+\return The number of bytes to copy, 0 if the device holds a current copy
+*/
+static cl_ulong array_migration_bytes(buffer_entry entry, cl_int size, int device_id, int num_devices)
+{
+	if(entry == NULL)
+		return size;
 
-				entry_lookup->coherent_flag[entry_lookup->valid_idx] = read_only_flag;
+	if(entry->state[device_id] != BUFFER_INVALID)
+		return 0;
 
-				free(data_for_copy);
-				cl_getTime(&begin_transfer_time);
-				cl_getTime(&end_time);
-				cl_getTime(&end_transfer_time);
-				total_buffer_time = total_buffer_time + cl_computeTime(begin_time, end_time);
-				total_transfer_time = total_transfer_time + cl_computeTime(begin_transfer_time, end_transfer_time);
-                //printf("Buffer transfer time for this frame: %f\n", cl_computeTime(begin_transfer_time, end_transfer_time));
-                //printf("Buffer management(transfer) time for this frame: %f\n", cl_computeTime(begin_time, end_time));
-				return entry_lookup->buffer[entry_lookup->valid_idx];					
-			}				
-		} //if(entry_lookup->data == (int)data)       
+	for(int i=0;i<num_devices;i++)
+	{
+		if(entry->state[i] == BUFFER_MODIFIED)
+			return 2 * (cl_ulong)entry->size;
 	}
 
-	//if the data is new to the buffer table
-	entry = (buffer_entry)malloc(sizeof(_buffer_entry));
-	entry->data = (int)data;
-	entry->num_devices = this->total_num_devices;
-	entry->pool_context = (work_pool_context)malloc(sizeof(_work_pool_context) * this->total_num_devices);
-	entry->buffer = (cl_mem *)malloc(sizeof(cl_mem) * this->total_num_devices);
-	entry->coherent_flag = (int *)malloc(sizeof(int) * this->total_num_devices);
+	return entry->size;
+}
 
-	entry->valid_idx = context_requested.work_pool_context_idx;
-	entry->pool_context[entry->valid_idx] = context_requested;
+//! Bytes a work unit needs to move to a device
+/*!
+Sum the copies of the array arguments which have no usable copy on the device yet
+\param work_unit_in, The work unit
+\param device_id, The device the work unit would run on
+\return The number of bytes to upload or migrate
+*/
+cl_ulong work_pool::bytes_to_migrate(work_unit* work_unit_in, int device_id)
+{
+	cl_ulong bytes = 0;
 
-	if (read_only_flag == READ_ONLY)
+	pthread_mutex_lock (&this->buffer_table_mutex);
+	for(unsigned int arg_num=0; arg_num <work_unit_in->arguments.size(); arg_num++)
 	{
-		entry->buffer[entry->valid_idx] = clCreateBuffer(context_requested.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-			size, data, &status);
-		cl_errChk(status, "Error creating read_only mem buffer", true);
-		entry->coherent_flag[entry->valid_idx] = READ_ONLY;
+		work_unit_arg arg = work_unit_in->arguments.at(arg_num);
+		if(arg->type != INT_ARRAY_TYPE && arg->type != FLOAT_ARRAY_TYPE)
+			continue;
+
+		bytes += array_migration_bytes(this->find_array_entry(arg->arg_pointer, arg->size), arg->size, device_id, this->total_num_devices);
 	}
-	else if (read_only_flag == WRITE_ONLY)
+	pthread_mutex_unlock (&this->buffer_table_mutex);
+
+	return bytes;
+}
+
+//! Data movement of a work unit on every device
+/*!
+One pass over the buffer table for all the devices
+\param work_unit_in, The work unit
+\param bytes_resident, Bytes of the array arguments already on each device, may be NULL
+\param bytes_to_migrate, Bytes to copy to each device, as bytes_to_migrate
+*/
+void work_pool::migration_costs(work_unit* work_unit_in, cl_ulong* bytes_resident, cl_ulong* bytes_to_migrate)
+{
+	for(unsigned int i=0;i<this->total_num_devices;i++)
 	{
-		entry->buffer[entry->valid_idx] = clCreateBuffer(context_requested.context, CL_MEM_WRITE_ONLY | CL_MEM_COPY_HOST_PTR,
-			size, data, &status);
-		cl_errChk(status, "Error creating write_only mem buffer", true);
-		entry->coherent_flag[entry->valid_idx] = WRITE_ONLY;
+		if(bytes_resident != NULL)
+			bytes_resident[i] = 0;
+		bytes_to_migrate[i] = 0;
 	}
-	else if (read_only_flag == READ_WRITE)
+
+	pthread_mutex_lock (&this->buffer_table_mutex);
+	for(unsigned int arg_num=0; arg_num <work_unit_in->arguments.size(); arg_num++)
 	{
-		entry->buffer[entry->valid_idx] = clCreateBuffer(context_requested.context, CL_MEM_READ_WRITE, size, NULL, &status);		
-		status |= clEnqueueWriteBuffer(context_requested.command_queue, entry->buffer[entry->valid_idx], CL_TRUE, 0, size, (void *)entry->data, 0, NULL, NULL);
-		if(status != CL_SUCCESS) {
-			printf("error creating read_write buffer\n");
-			exit(-1);
+		work_unit_arg arg = work_unit_in->arguments.at(arg_num);
+		if(arg->type != INT_ARRAY_TYPE && arg->type != FLOAT_ARRAY_TYPE)
+			continue;
 
+		buffer_entry entry = this->find_array_entry(arg->arg_pointer, arg->size);
+		for(unsigned int i=0;i<this->total_num_devices;i++)
+		{
+			cl_ulong bytes = array_migration_bytes(entry, arg->size, i, this->total_num_devices);
+			bytes_to_migrate[i] += bytes;
+			if(bytes == 0 && bytes_resident != NULL)
+				bytes_resident[i] += arg->size;
 		}
-		entry->coherent_flag[entry->valid_idx] = READ_WRITE;
 	}
-	else
+	pthread_mutex_unlock (&this->buffer_table_mutex);
+}
+
+//! Pick the device with the cheapest data movement among the devices finishing about as early as the best one
+/*!
+Devices whose finish estimate is within LOCALITY_TOLERANCE of the earliest
+compete on the bytes to migrate, then on the bytes already resident, then
+on the estimate
+\param work_unit_in, The work unit to place
+\param finish, The policy's finish estimate per device, lower is better
+\return The device
+*/
+int work_pool::prefer_resident(work_unit* work_unit_in, const double* finish)
+{
+	int best_device = 0;
+	for(unsigned int i=1;i<this->total_num_devices;i++)
 	{
-		printf("error type of buffer requested\n");
-		exit(-1);
+		if(finish[i] < finish[best_device])
+			best_device = i;
 	}
 
-    /*if(read_only_flag == CL_TRUE)
+	std::vector<cl_ulong> resident(this->total_num_devices), to_migrate(this->total_num_devices);
+	this->migration_costs(work_unit_in, &resident[0], &to_migrate[0]);
+
+	double limit = finish[best_device] + LOCALITY_TOLERANCE * (finish[best_device] > 0 ? finish[best_device] : -finish[best_device]);
+	int chosen = best_device;
+	for(unsigned int i=0;i<this->total_num_devices;i++)
 	{
-		status = clEnqueueWriteBuffer(context_requested.command_queue, entry->buffer[entry->valid_idx], CL_TRUE, 0, 
-									  size, data, 0, NULL, NULL); 
-		if(status != CL_SUCCESS) {
-			printf("error copying data to buffer\n");
-			exit(-1);
-		}
-	}*/
+		if(finish[i] > limit)
+			continue;
+
+		if(to_migrate[i] < to_migrate[chosen]
+			|| (to_migrate[i] == to_migrate[chosen] && resident[i] > resident[chosen])
+			|| (to_migrate[i] == to_migrate[chosen] && resident[i] == resident[chosen] && finish[i] < finish[chosen]))
+			chosen = i;
+	}
+
+#ifdef VERBOSE
+	if(chosen != best_device)
+		printf("@@@@@@ [Enqueue]: Work unit no.%d placed on device %d instead of %d, %lu bytes to migrate instead of %lu\n", work_unit_in->unit_index, chosen, best_device, (unsigned long)to_migrate[chosen], (unsigned long)to_migrate[best_device]);
+#endif
+
+	return chosen;
+}
 
-	//cl_copyToDevice_workpool(context.command_queue, buffer_entry->buffer[i], buffer_entry->data, size);
+//! Hand the host array of an output over to the commands writing it
+/*!
+A modified device copy is queued back to the host array and every device
+copy is marked stale, the host array is the only one the writers keep
+current. Nothing blocks: the events of the write-back and of every command
+still using the array are appended to wait_list
+\param data, The original host data pointer
+\param device_id, The device whose command queue waits for the events
+\param wait_list, The events are appended to this list, in the context of device_id, and released by the caller
+*/
+void work_pool::buffer_take_host(void *data, int device_id, std::vector<cl_event> &wait_list)
+{
+	cl_context to = this->context[device_id].context;
 
-		this->buffer_table.entry_list.push_back(entry);
-		buffer_table.num_entries++;
-		cl_getTime(&end_time);
-		total_buffer_time = total_buffer_time + cl_computeTime(begin_time, end_time);
-    //printf("Buffer management(new) time for this frame: %f\n", cl_computeTime(begin_time, end_time));
-		return entry->buffer[entry->valid_idx];
+	pthread_mutex_lock (&this->buffer_table_mutex);
+	buffer_entry entry = this->find_array_entry(data);
+	if(entry != NULL)
+	{
+		//the write-back is one more reader of the modified copy
+		for(unsigned int i=0;i<this->total_num_devices;i++)
+		{
+			if(entry->state[i] == BUFFER_MODIFIED)
+				this->transfer_buffer(entry, i, -1);
+		}
 
+		for(unsigned int i=0;i<this->total_num_devices;i++)
+		{
+			if(entry->write_event[i] != NULL)
+				wait_list.push_back(bridge_event(entry->write_event[i], entry->pool_context[i].context, to));
+			for(unsigned int k=0;k<entry->read_events[i].size();k++)
+				wait_list.push_back(bridge_event(entry->read_events[i].at(k), entry->pool_context[i].context, to));
+			if(entry->host_read_event[i] != NULL)
+				wait_list.push_back(bridge_event(entry->host_read_event[i], entry->pool_context[i].context, to));
+
+			entry->state[i] = BUFFER_INVALID;
+		}
 	}
+	pthread_mutex_unlock (&this->buffer_table_mutex);
+}
 
 //! Query the information of the next work unit
 /*!
-Query the information of the next work unit
+Query the information of the next work unit of a device
+\param device_id, The device whose queue is queried, -1 for the device with most queued work units
+\return The index of the next work unit, 0 if the queue is empty
 */
-cl_uint work_pool::query()
+cl_uint work_pool::query(int device_id)
 {
-	//pthread_mutex_lock (&this->work_unit_q_mutex);
-	if(this->work_pool_start[this->index_out] == (work_unit *)0xcdcdcdcd)
-		return 0;
-	else
+	cl_uint unit_index = 0;
+
+	if(device_id < 0)
 	{
-		//pthread_mutex_unlock (&this->work_unit_q_mutex);
-		return this->work_pool_start[this->index_out]->unit_index;
+		cl_uint most_units = 0;
+		for(unsigned int i=0;i<this->total_num_devices;i++)
+		{
+			if(this->device_queue[i].num_units > most_units)
+			{
+				most_units = this->device_queue[i].num_units;
+				device_id = i;
+			}
+		}
+		if(device_id < 0)
+			return 0;
 	}
-	
-	//return 0;
+
+	pthread_mutex_lock (&this->device_queue[device_id].lock);
+	int level = queue_next_level(&this->device_queue[device_id], 0);
+	work_unit *critical = this->critical_unit(&this->device_queue[device_id], -1);
+	if(critical != NULL && (level < 0 || (int)critical->queue_level <= level || (this->deadline_first && critical->deadline != 0)))
+		unit_index = critical->unit_index;
+	else if(level >= 0)
+		unit_index = this->device_queue[device_id].bucket[level].head->unit_index;
+	pthread_mutex_unlock (&this->device_queue[device_id].lock);
+
+	return unit_index;
 }
 
 //! Reset the buffer used in one frame
 /*!
-Reset the buffer used in one frame, and release the buffer
+Reset the buffer used in one frame. The device buffers of the arrays are
+kept for the next frame up to the recycle limit of each device, once the
+commands using them complete; other threads may use the empty table
+meanwhile.
 \param thread_id, The thread id which calls this function (for debugging)
 */
 void work_pool::reset_buffer(int thread_id)
 {
 	
 	cl_int status;
+	std::vector<buffer_entry> entries;
 
-	for(unsigned int j=0;j<this->buffer_table.entry_list.size();j++)
+	//the table is emptied at once, its buffers are waited for without the lock
+	pthread_mutex_lock (&this->buffer_table_mutex);
+	entries.swap(this->buffer_table.entry_list);
+	this->buffer_table.num_entries  = 0;
+	this->buffer_table.buckets.assign(BUFFER_TABLE_BUCKETS, (buffer_entry)NULL);
+	this->buffer_table.arrays.clear();
+	pthread_mutex_unlock (&this->buffer_table_mutex);
+
+	//the next frame may get the buffers, they must be idle; the events of a device are in its context
+	for(int i=0;i<this->buffer_table.num_devices;i++)
+	{
+		std::vector<cl_event> last_use;
+		for(unsigned int j=0;j<entries.size();j++)
+		{
+			buffer_entry entry = entries.at(j);
+			if(entry->parent != NULL || entry->buffer[i] == NULL)
+				continue;
+
+			last_use.insert(last_use.end(), entry->read_events[i].begin(), entry->read_events[i].end());
+			if(entry->write_event[i] != NULL)
+				last_use.push_back(entry->write_event[i]);
+		}
+		if(!last_use.empty())
+			clWaitForEvents(last_use.size(), &last_use[0]);
+	}
+
+	pthread_mutex_lock (&this->buffer_table_mutex);
+
+	//newest first, the slices go before the arrays they were cut from
+	for(unsigned int j=entries.size();j-->0;)
 	{
 	//printf("thread_id: %d, buffer entry no. %d\n", thread_id, j);
-		buffer_entry entry = this->buffer_table.entry_list.at(j);
+		buffer_entry entry = entries.at(j);
 		for(int i=0;i<this->buffer_table.num_devices;i++)
 		{
-			if(entry->buffer[i] != (cl_mem)0xcdcdcdcd)
+			if(entry->buffer[i] != NULL && entry->buffer[i] != (cl_mem)0xcdcdcdcd)
 			{
-				status = clReleaseMemObject(entry->buffer[i]);
-				cl_errChk(status, "Releasing mem object", true);
+				if(entry->parent != NULL)
+				{
+					status = clReleaseMemObject(entry->buffer[i]);
+					cl_errChk(status, "Releasing mem object", true);
+				}
+				else
+				{
+					this->recycle_device_buffer(i, entry->buffer[i]);
+				}
 			}
+			if(entry->write_event[i] != NULL)
+				clReleaseEvent(entry->write_event[i]);
+			for(unsigned int k=0;k<entry->read_events[i].size();k++)
+				clReleaseEvent(entry->read_events[i].at(k));
+			if(entry->host_read_event[i] != NULL)
+				clReleaseEvent(entry->host_read_event[i]);
 		}
+		if(entry->host_write_event != NULL)
+			clReleaseEvent(entry->host_write_event);
+		free_buffer_entry(entry);
 	}
 
-	this->buffer_table.num_entries  = 0;
-	this->buffer_table.entry_list.clear();
+	//a peak frame does not trim the buffers the next frames would create again
+	for(unsigned int i=0;i<this->total_num_devices;i++)
+	{
+		if(this->recycled_bytes[i] <= this->recycle_limit[i])
+		{
+			this->recycle_oversized[i] = 0;
+			continue;
+		}
+
+		this->recycle_oversized[i]++;
+		if(this->recycle_oversized[i] >= RECYCLE_TRIM_RESETS || this->recycle_limit[i] == 0)
+		{
+#ifdef VERBOSE
+			printf("@@@@@@ [Buffer]: trimming %lu bytes of free buffers on device %d\n", (unsigned long)(this->recycled_bytes[i] - this->recycle_limit[i]), i);
+#endif
+			this->trim_recycled(i, this->recycle_limit[i]);
+			this->recycle_oversized[i] = 0;
+		}
+	}
+
+	pthread_mutex_unlock (&this->buffer_table_mutex);
 
 	//num_work_units = 0;
 	//work_pool_state = WORK_POOL_EMPTY;
 
 }
 
+//! Wait until every enqueued work unit has completed
+/*!
+Returns as soon as the kernel and write-backs of the last work unit
+complete and it is retired, its handle resolved and its continuations run.
+The work pool stays open for more work units
+*/
+void work_pool::wait_idle()
+{
+	pthread_mutex_lock (&this->inflight_mutex);
+	while(this->num_pending_units != 0)
+		pthread_cond_wait(&this->idle_cv, &this->inflight_mutex);
+	pthread_mutex_unlock (&this->inflight_mutex);
+}
+
 //! work_pool_finish, join all the threads
 /*!
-Query the information of the next work unit
+Wait for all the work units, stop and join the scheduler threads, and release the buffers
 */
 void work_pool::finish()
 {
-	
-	while(this->num_work_units != 0 && this->work_pool_state != WORK_POOL_EMPTY);
+	this->wait_idle();
 	this->done = 1;
 
+	//wake up the devices sleeping on an empty queue or a full in-flight window, so they see done
+	pthread_mutex_lock (&this->work_unit_q_mutex);
+	pthread_cond_broadcast(&this->work_unit_q_not_empty_cv);
+	pthread_mutex_unlock (&this->work_unit_q_mutex);
+
+	pthread_mutex_lock (&this->inflight_mutex);
+	pthread_cond_broadcast(&this->inflight_cv);
+	pthread_mutex_unlock (&this->inflight_mutex);
+
+	for(int i=0;i<this->total_num_devices;i++)
+	{
+		pthread_join(this->work_pool_scheduler_thread[i], NULL);
+	}
+
+	this->reset_buffer(0);
+	pthread_mutex_lock (&this->buffer_table_mutex);
+	for(unsigned int i=0;i<this->total_num_devices;i++)
+		this->trim_recycled(i, 0);
+	pthread_mutex_unlock (&this->buffer_table_mutex);
+	this->free_staging();
+	work_pool_ring_release(&this->submit_ring);
+
+	//no thread uses them any more
 	pthread_mutex_destroy(&this->work_unit_q_mutex);
 	pthread_cond_destroy(&this->work_unit_q_full_cv);
 	pthread_cond_destroy(&this->work_unit_q_not_empty_cv);
-	
-	while(1)
+	pthread_mutex_destroy(&this->buffer_table_mutex);
+	pthread_mutex_destroy(&this->inflight_mutex);
+	pthread_cond_destroy(&this->inflight_cv);
+	pthread_cond_destroy(&this->idle_cv);
+	pthread_mutex_destroy(&this->split_mutex);
+	pthread_mutex_destroy(&this->stream_mutex);
+	pthread_mutex_destroy(&this->staging_mutex);
+
+	if(this->num_deadline_units != 0)
+		printf("!!!!!! %d of %d work units with a deadline missed it\n", this->num_missed_deadlines, this->num_deadline_units);
+
+	for(unsigned int i=0;i<this->streams.size();i++)
 	{
-		sleep(1000);
-		int exit = 1;
-		for(int i=0;i<this->total_num_devices;i++)
-		{
-			exit &= this->thread_exit[i];
-		}		
-		if(exit == 1)
-			break;
+		printf("!!!!!! stream %s: %d work units, %f ms of device time\n", this->streams.at(i)->name, this->streams.at(i)->num_completed, this->streams.at(i)->device_time);
+		free(this->streams.at(i));
 	}
-	//Sleep(100000);
-
-	this->reset_buffer(0);
-	
-	//pthread_attr_destroy(&this->work_pool_thread_attr);
+	this->streams.clear();
+	this->num_streams = 0;
 
-	/*for(int i=0;i<this->total_num_devices;i++)
+	for(int i=0;i<this->total_num_devices;i++)
 	{
-		pthread_join(this->work_pool_scheduler_thread[i], NULL);
-	}*/
-
-
-
-	//pthread_exit(NULL);
-
-		for(int i=0;i<this->total_num_devices;i++)
-		{
-			printf("!!!!!! on %d device, %d work units were executed\n", i, num_on_this_device[i]);
-		}
+		printf("!!!!!! on %d device, %d work units were executed\n", i, num_on_this_device[i]);
+	}
 
 #ifdef VERBOSE
-		for(int i=0;i<this->total_num_devices;i++)
+	for(int i=0;i<this->total_num_devices;i++)
+	{
+		for(int j=0;j<this->num_on_this_device[i];j++)
 		{
-			for(int j=0;j<this->num_on_this_device[i];j++)
-			{
-				printf("!!!!!! on %d device, execution time of %d work units is %f\n", i, j, this->execution_time_queue_per_device[i][j]);
-			}
+			printf("!!!!!! on %d device, execution time of %d work units is %f\n", i, j, this->execution_time_queue_per_device[i][j]);
 		}
-#endif	
 	}
+#endif	
+}
@@ -1,6 +1,7 @@
 #include <CL/cl.h>
 #include <CL/cl_ext.h>
 #include <vector>
+#include <map>
 #include <pthread.h>
 
 #ifdef _WIN32
@@ -14,9 +15,49 @@ typedef double cl_time;
 
 //#define PRINT_PROFILING
 
-#define WORKPOOL_CAP 22
+#define WORKPOOL_CAP 22 //capacity when init is given no max_size
+#define CL_WORKPOOL_FULL -1100 //status of try_enqueue and enqueue_for when the pool stays full
 #define PRIORITY_LEVEL 256
-
+#define PRIORITY_BUCKETS (PRIORITY_LEVEL+1) //0 is the highest priority, PRIORITY_LEVEL the lowest
+#define PRIORITY_WORDS ((PRIORITY_BUCKETS+31)/32)
+#define AGING_INTERVAL 16 //work units taken from a device queue between two aging rounds
+#define AGING_STEP 16 //priority levels the oldest waiting work unit of a level moves up per aging round
+#define STREAM_QUANTUM 1.0 //ms of device time a stream of weight 1 is given per round
+#define STREAM_DEPTH 2 //work units per device let out of the streams and not taken yet
+#define MAX_STREAM_NAME 64
+
+#define DEFAULT_TRANSFER_RATE 1000000.0 //bytes per ms
+#define TRANSFER_RATE_SMOOTHING 0.25
+
+#define DEFAULT_INFLIGHT_DEPTH 2
+#define INFLIGHT_ENV "WORKPOOL_INFLIGHT"
+#define AFFINITY_ENV "WORKPOOL_AFFINITY" //core per scheduler thread, in device order, e.g. "0,8", -1 for none
+#define CPU_PARTITION_UNITS 2 //compute units of the CPU sub-device
+#define WP_MAX_NUMA_NODES 64
+#define BUFFER_TABLE_BUCKETS 64 //initial size of the buffer table index, doubled when there are more entries
+#define MIGRATION_CHUNK_SIZE (4 << 20) //bytes per command of a migration through the host, reads and writes of successive chunks overlap
+#define STAGING_MIN_SIZE (64 << 10) //smallest staging buffer, the size classes double up to MIGRATION_CHUNK_SIZE
+#define STAGING_CLASSES 7
+#define RECYCLE_MIN_SIZE (4 << 10) //smallest device buffer, buffers are allocated in power of two size classes so they can be reused
+#define RECYCLE_CLASSES 20
+#define RECYCLE_LIMIT_ENV "WORKPOOL_BUFFER_POOL" //MB of free device buffers kept per device across reset_buffer
+#define DEFAULT_RECYCLE_LIMIT 256
+#define RECYCLE_TRIM_RESETS 3 //resets the free buffers must stay above the limit before they are trimmed
+
+
+// Atomic operations on the work pool counters
+#ifdef _WIN32
+#define WP_ATOMIC_ADD(ptr, val) (InterlockedExchangeAdd((volatile LONG *)(ptr), (LONG)(val)) + (LONG)(val))
+#define WP_ATOMIC_CAS(ptr, oldval, newval) (InterlockedCompareExchange((volatile LONG *)(ptr), (LONG)(newval), (LONG)(oldval)) == (LONG)(oldval))
+#define WP_MEMORY_BARRIER() MemoryBarrier()
+static __inline int wp_first_set(unsigned long bits) { unsigned long index; _BitScanForward(&index, bits); return (int)index; }
+#define WP_FIRST_SET(bits) wp_first_set(bits)
+#else
+#define WP_ATOMIC_ADD(ptr, val) __sync_add_and_fetch((ptr), (val))
+#define WP_ATOMIC_CAS(ptr, oldval, newval) __sync_bool_compare_and_swap((ptr), (oldval), (newval))
+#define WP_MEMORY_BARRIER() __sync_synchronize()
+#define WP_FIRST_SET(bits) __builtin_ctz(bits)
+#endif
 
 // Init extension function pointers
 #define INIT_CL_EXT_FCN_PTR(platform, name) \
@@ -28,9 +69,10 @@ if(!pfn_##name) { \
 	} \
 }
 
-static int starvation = 0;
 static int full = 0;
 
+class work_unit_future;
+
 typedef struct {
 	cl_context context;
 	cl_kernel kernel;
@@ -39,6 +81,7 @@ typedef struct {
 	const size_t* global_work_size;
 	const size_t* local_work_size;
 	cl_int status;
+	work_unit_future* handle; //completion of the work unit once enqueued, NULL before
 } _cl_workunit, *cl_workunit;
 
 typedef struct {
@@ -96,6 +139,10 @@ cl_int clWaitForDependency(cl_dependency dep);
 #define CL_WORKUNIT_COMPLETE    0x0003
 #define CL_WORKUNIT_INVALID     0x0004
 
+#define CL_WORKUNIT_SPLIT       0x0100 //flag: split the NDRange of the work unit across all devices
+
+#define CHUNK_FACTOR 2 //a device takes 1/CHUNK_FACTOR of its share of the remaining range
+
 #define FALSE 0
 #define TRUE 1
 
@@ -143,21 +190,40 @@ typedef struct {
 	cl_kernel* pre_compiled_kernels;
 } _pre_compiled_kernels_per_context, *pre_compiled_kernels_per_context;
 
-typedef struct {
+typedef struct _buffer_entry {
 	cl_int num_devices;
-	int data;
+	void *data;
+	cl_int size;
+	struct _buffer_entry *hash_next; //next entry of the same hash bucket
+	struct _buffer_entry *parent; //entry this one is a slice of, NULL for a whole array
+	size_t offset; //byte offset of the slice in the parent
 	work_pool_context pool_context;	
 	cl_mem* buffer;
-	cl_int valid_idx;
-	int* coherent_flag; //1->read_only; 2->write_only; 3->read_write
+	int* state; //coherence state of the copy on each device, BUFFER_INVALID to BUFFER_MODIFIED
+	cl_event* write_event; //last command writing the buffer, per device
+	std::vector<cl_event>* read_events; //commands reading the buffer since that write, per device
+	cl_event host_write_event; //last copy into the host array, on host_write_device
+	int host_write_device;
+	cl_event* host_read_event; //last upload from the host array, per device
 } _buffer_entry, *buffer_entry;
 
 
+//! Device buffers of the host arrays
+/*!
+entry_list keeps the entries in creation order, the hash index finds the
+entry of a host pointer and size in constant time. A range inside an array
+already in the table becomes a slice of it, whose device buffers are
+sub-buffers of the array's ones; arrays indexes the outermost arrays by
+start address to find the one enclosing a range in logarithmic time
+*/
 typedef struct {
 	cl_int              num_devices;
 	//work_pool_context	pool_context;	
 	cl_int              num_entries;	
 	std::vector<buffer_entry> entry_list;
+	std::vector<buffer_entry> buckets; //hash index on the host pointer, a power of two long
+	std::map<char *, buffer_entry> arrays; //arrays not inside another one, by start address
+	size_t sub_buffer_align; //bytes a slice offset must be a multiple of on every device
 } _buffer_table, buffer_table;
 
 typedef struct {
@@ -174,7 +240,231 @@ typedef struct {
 
 
 class work_pool;
+class work_unit;
+
+typedef struct {
+	work_unit *head, *tail;
+} _priority_bucket;
+
+//! Queue of work units owned by one device
+/*!
+One FIFO list per priority level, linked through the work units, and a
+bitmap of the non-empty levels to find the highest priority in constant
+time. The owning scheduler thread takes from the head of a level, idle
+devices steal from the tail. Every AGING_INTERVAL units taken, the oldest
+unit of each lower level moves up AGING_STEP levels, so it can not starve.
+Ready work units of dependency graphs are kept apart in binary heaps and
+taken longest remaining path first, the priority level breaking ties; they
+go before the units of the buckets unless those have a higher priority.
+Units bound to the owner by a parent's kernel event have a heap of their
+own, so thieves find the best unit they may take at the top of the other.
+num_units is updated atomically and read without the lock to pick the
+device to push to or steal from.
+*/
+typedef struct {
+	pthread_mutex_t lock;
+	_priority_bucket bucket[PRIORITY_BUCKETS];
+	cl_uint priority_map[PRIORITY_WORDS]; //bit set for every non-empty level
+	cl_uint starvation; //units taken since the last aging round
+	std::vector<work_unit *> critical; //ready units of dependency graphs any device may take, a heap
+	std::vector<work_unit *> critical_bound; //those bound to the owner by the kernel event of a parent, a heap
+	cl_bool deadline_first; //the heaps put the units with a deadline first, earliest first
+	volatile cl_uint num_units; //queued units, and submitted units on their way to the queue
+} _work_pool_deque, *work_pool_deque;
+
+//! Submission stream of one job sharing the work pool
+/*!
+Work units of a stream wait in its FIFO until deficit round-robin lets
+them out to the device queues: every turn a stream is given its weight
+times STREAM_QUANTUM of device time and lets out units while their
+estimated time fits. The estimate is corrected by the measured kernel time
+on completion, so every stream gets its weighted share of device time.
+*/
+typedef struct {
+	char name[MAX_STREAM_NAME];
+	double weight;
+	double deficit; //ms of device time the stream may still use in this round
+	work_unit *head, *tail; //waiting work units, linked through queue_prev and queue_next
+	cl_uint num_waiting;
+	cl_uint num_completed;
+	double device_time; //measured ms of the completed work units
+} _work_pool_stream, *work_pool_stream;
+
+typedef struct {
+	volatile cl_uint sequence;
+	void *data;
+} _ring_cell;
+
+//! Bounded lock-free multi-producer multi-consumer ring of pointers
+/*!
+Every cell carries a sequence number telling whether it is free for the
+push at head or full for the pop at tail, so producers and consumers only
+race on head and tail with a compare-and-swap (Vyukov's bounded queue).
+*/
+typedef struct {
+	_ring_cell *cells;
+	cl_uint mask;
+	volatile cl_uint head; //position of the next push
+	volatile cl_uint tail; //position of the next pop
+} _work_pool_ring, *work_pool_ring;
+
+cl_int work_pool_ring_init(work_pool_ring ring, cl_uint capacity);
+cl_bool work_pool_ring_push(work_pool_ring ring, void *data);
+void* work_pool_ring_pop(work_pool_ring ring);
+void work_pool_ring_release(work_pool_ring ring);
+
+//! Pinned host memory for the transfers of one device
+/*!
+Mapped once for the life of the buffer. Transfers between the host arrays
+and the devices are copied through it, so the runtime does not stage
+pageable memory itself.
+*/
+typedef struct {
+	cl_mem buffer;
+	void *host_ptr;
+	void *memory; //from host_alloc when the buffer uses host memory of the device's node, NULL otherwise
+	size_t size;
+	int device_id;
+	work_pool *pool;
+} _staging_buffer, *staging_buffer;
+
+//! Decisions a scheduling policy can return for a device thread
+#define POLICY_TAKE   0x0000 //extract the next work unit on this device
+#define POLICY_SKIP   0x0001 //leave the next work unit to another device
+#define POLICY_RETIRE 0x0002 //this device takes no more work units
+
+#define MAX_POLICIES 16
+#define POLICY_ENV "WORKPOOL_POLICY"
+#define DEFAULT_POLICY "static_ability"
+
+#define DYNAMIC_SMOOTHING 0.3
+#define HEFT_SMOOTHING 0.3
+#define HEFT_DEFAULT_ESTIMATE 1.0 //ms, before any kernel is measured
+#define LOCALITY_TOLERANCE 0.25 //finish estimates within this fraction of the best are close, the data decides
+#define EDF_SMOOTHING 0.3
+
+//! Scheduling policy interface
+/*!
+A policy decides, for every scheduler thread, whether the next work unit
+in the pool is taken by that thread's device. One policy instance is
+owned by each work pool and is shared by all of its scheduler threads.
+*/
+class work_pool_policy {
+
+public:
+
+	virtual ~work_pool_policy() {}
+
+	virtual const char* name() = 0;
 
+	//! Called once from work_pool::init, before the scheduler threads start
+	virtual void init(work_pool *) {}
+
+	//! Called by enqueue to choose the device queue a new work unit is pushed to
+	/*!
+	May be called from several producer threads at once. The default pushes
+	to the device with the fewest queued work units.
+	*/
+	virtual int place(work_pool *work_pool, work_unit *work_unit);
+
+	//! Called by an idle scheduler thread before it steals from another device
+	virtual cl_bool steal(work_pool *, int) { return CL_TRUE; }
+
+	//! Called by a scheduler thread before it extracts the next work unit
+	virtual cl_int select(work_pool *work_pool, int device_id, cl_uint unit_index) = 0;
+
+	//! Called by enqueue to estimate the execution time of a work unit, in ms
+	/*!
+	Used to rank the work units of a dependency graph by the length of
+	their remaining path. The default counts every kernel the same.
+	*/
+	virtual double cost(work_pool *, work_unit *) { return HEFT_DEFAULT_ESTIMATE; }
+
+	//! Whether device queues take the work units with a deadline earliest deadline first
+	virtual cl_bool earliest_deadline_first() { return CL_FALSE; }
+
+	//! Called when the commands of a work unit have finished
+	/*!
+	Called from the OpenCL runtime's callback thread with the in-flight lock
+	held, after unit_end_time, num_completed_on_this_device and
+	execution_time_queue_per_device are updated.
+	*/
+	virtual void complete(work_pool *, int, work_unit *) {}
+};
+
+typedef work_pool_policy* (*work_pool_policy_factory)();
+
+cl_int work_pool_register_policy(const char* name, work_pool_policy_factory factory);
+work_pool_policy* work_pool_create_policy(const char* name);
+
+class work_unit;
+typedef work_unit_future* work_unit_handle;
+
+//! Completion of one enqueued work unit
+/*!
+Resolved when the kernel and the write-backs of the work unit have
+completed. Continuations run on the OpenCL callback thread and must not
+block. The pool and the caller each hold a reference, the caller drops
+its own with release.
+The handle is also the node of the work unit in the dependency graph:
+work units enqueued after it wait in the pool until it is issued to a
+device or has completed.
+*/
+class work_unit_future {
+
+public:
+
+	work_unit_future();
+
+	cl_int wait();
+	cl_bool test();
+	void then(void (*pfn_notify)(work_unit_handle handle, cl_int status, void* user_data), void* user_data);
+	cl_event get_event(cl_context context, cl_int* status);
+	void retain();
+	void release();
+
+	cl_bool add_child(work_unit* child);
+	void issue(int device_id, cl_event kernel_event);
+	cl_event issued_event(int device_id);
+	void resolve(cl_int status);
+
+	void set_cost(double cost, work_unit_future** parents, cl_uint num_parents);
+	double get_rank();
+	void raise_rank(double child_rank);
+	void set_queued(work_unit* unit);
+
+private:
+
+	typedef struct {
+		work_unit* child;
+		cl_bool released; //the child no longer waits for this work unit
+	} dependent;
+
+	typedef struct {
+		void (*pfn_notify)(work_unit_handle handle, cl_int status, void* user_data);
+		void* user_data;
+	} continuation;
+
+	~work_unit_future();
+
+	pthread_mutex_t lock;
+	pthread_cond_t resolved_cv;
+	cl_bool resolved;
+	cl_int status; //CL_SUCCESS, or the error of the first failed command
+	volatile cl_uint num_references;
+	std::vector<continuation> continuations;
+	std::vector<cl_event> user_events;
+
+	cl_bool issued;
+	int device_id; //the device the kernel was issued to
+	cl_event kernel_event; //retained until the handle is deleted
+	std::vector<dependent> children;
+
+	double cost; //estimated ms of the work unit itself
+	double rank; //upward rank: cost plus the longest rank of the children
+	std::vector<work_unit_future *> parents; //retained until resolved, to pass rank increases up
+	work_unit* queued; //the work unit once ready, moved up its device queue when the rank grows
+};
 
 class work_unit {
 
@@ -222,10 +512,50 @@ public:
 	cl_uint flags;
 	cl_uint work_unit_status;
 
+	//set when the work unit is distributed to a device
+	work_pool *pool;
+	int device_id;
+	volatile cl_uint pending_events;
+	cl_event kernel_event;
+
+	int home_device; //the device queue the work unit was placed in
+	cl_uint queue_level; //priority level in the device queue, raised by aging
+	work_unit *queue_prev, *queue_next; //links of the priority level in the device queue
+	double estimated_time; //set by the policy when placing the work unit, in ms
+	double kernel_time; //measured kernel execution time, in ms
+	cl_int execution_status; //CL_SUCCESS, or the error of a failed command
+	work_unit_future *future; //resolved on completion, NULL if the caller did not ask for a handle
+
+	//dependency graph, set with depends_on before enqueueing
+	cl_uint num_parents;
+	const work_unit_handle *parents; //the work units this one waits for, retained by the copy in the pool
+	volatile cl_uint num_waiting_parents; //parents neither issued to the same device nor complete
+	volatile int dag_device; //the device the work unit is bound to by an issued parent, -1 if none
+	cl_bool ranked; //part of a dependency graph, queued by upward rank
+	double rank_key; //the upward rank the device queue orders the unit by, written under the queue lock once queued
+	int heap_index; //position in the critical heap of the device queue, -1 if not in one
+	double own_cost; //estimated kernel and input transfer ms, the rank of a unit without handle
+	cl_int stream; //the submission stream, 0 for the default one
+	cl_time deadline; //absolute, in the clock of cl_getTime, 0 for none
+	cl_bool stream_admitted; //let out of its stream by the round-robin
+
+	void set_stream(cl_int stream);
+
+	void depends_on(const work_unit_handle* parent_list, cl_uint num_parents);
+
 	//cl_uint kernel_index;
 
 	//pre_compiled_kernels_per_context pre_compiled_kernels_per_context;
 
+	//set for the split work units in progress
+	work_unit *split_parent; //the split work unit a chunk belongs to, NULL if not a chunk
+	size_t split_next; //the next work group to hand out
+	size_t split_groups; //work groups along the last dimension, 0 if not split
+	size_t min_chunk_size, max_chunk_size; //bounds of a chunk in work items along the last dimension, 0 for no bound
+	cl_event split_ready; //the chunks wait for it, on the queue of device_id, NULL if they need not wait
+
+	void set_chunk_bounds(size_t min_chunk_size, size_t max_chunk_size);
+
 	cl_program compile_program(_work_pool_context context, char * program_path, char * compileoptions, bool verbosebuild);
 	cl_kernel create_kernel(cl_program program, const char* kernel_name);
 	void set_argument(cl_int index, cl_int type, cl_int int_value, float float_value, void * data, cl_int data_size, cl_int flag, cl_int * status);
@@ -251,25 +581,25 @@ class work_pool {
 		//! Standard Constructor
 		work_pool( );
 		void init(int max_size, unsigned int init_number_work_units, cl_int* status);
+		void init(int max_size, unsigned int init_number_work_units, const char* policy_name, cl_int* status);
 
 		work_pool_context context;
-		work_unit **work_pool_start;
-		//work_unit *work_pool_end;
-		//work_unit *work_pool_in;
-		//work_unit *work_pool_out;
-		unsigned int index_end;
-		unsigned int index_in;
-		unsigned int index_out;
+		work_pool_deque device_queue;
+		_work_pool_ring submit_ring; //enqueued work units not yet moved to their device queue
 
 		unsigned int work_unit_index;
 
 
 		cl_uint max_size;
-		cl_uint num_work_units;
+		volatile cl_uint capacity; //work units the pool holds before producers wait
+		cl_uint max_capacity; //capacity the pool may grow to
+		volatile cl_uint num_work_units;
+		volatile cl_uint num_held_units; //work units waiting in the dependency graph, not in a queue
 		cl_uint work_pool_status;
 		cl_uint total_num_devices;
 
-		cl_uint num_sleeping_devices;
+		volatile cl_uint num_sleeping_devices;
+		volatile cl_uint ready_version; //bumped every time a work unit becomes ready
 
 		cl_uint work_pool_state;
 
@@ -279,35 +609,102 @@ class work_pool {
 
 		pthread_t *work_pool_scheduler_thread;
 		pthread_attr_t work_pool_thread_attr;
+		std::vector<int> thread_cores; //core each scheduler thread is pinned to, -1 for none
+		int *device_node; //NUMA node of the host memory for each device, -1 if unknown
+		std::vector<staging_buffer> *staging_free; //free staging buffers per device and size class
+		pthread_mutex_t staging_mutex;
+
+		std::vector<cl_mem> *recycled_buffers; //free device buffers per device and size class, under buffer_table_mutex
+		cl_ulong *recycled_bytes; //bytes of the free device buffers per device
+		cl_ulong *recycle_limit; //high-water mark of recycled_bytes per device
+		cl_uint *recycle_oversized; //consecutive resets which left recycled_bytes above the limit
 		void* work_pool_scheduler_arg;
 
 		pthread_mutex_t work_unit_q_mutex;
 		pthread_cond_t work_unit_q_not_empty_cv;
 		pthread_cond_t work_unit_q_full_cv;
 
+		pthread_mutex_t buffer_table_mutex;
+
 		unsigned int done;
 		unsigned int extract_done;
 
 		unsigned int *num_on_this_device;
+		unsigned int *num_completed_on_this_device;
+
+		cl_uint *inflight_depth;
+		volatile cl_uint *num_inflight;
+		pthread_mutex_t inflight_mutex;
+		pthread_cond_t inflight_cv;
+		volatile cl_uint num_pending_units; //enqueued work units not completed yet
+		pthread_cond_t idle_cv; //signalled with inflight_mutex when num_pending_units drops to 0
 
 		unsigned int *thread_exit;
 
 		unsigned int total_unfinished_work_units;
 
+		work_pool_policy *policy;
+
 	//for profiling
 		cl_time *unit_start_time, *unit_end_time;
 
 		double **execution_time_queue_per_device;
-	unsigned int *busy_direction; //0-stay;1-UP, more busier;2-DOWN, less busier
-	int *dynamic_offset;
+		double *transfer_rate; //smoothed host to device bytes per ms
+		double *split_weight; //share of a split work unit per device
+
+		std::vector<work_unit *> active_splits; //split work units with chunks left to hand out
+		volatile cl_uint num_active_splits;
+		pthread_mutex_t split_mutex;
+
+		std::vector<work_pool_stream> streams; //empty until a stream is created, then stream 0 is the default one
+		volatile cl_uint num_streams;
+		pthread_mutex_t stream_mutex;
+		cl_uint stream_turn; //the stream the round-robin visits
+		cl_bool stream_turn_given; //the visited stream got its quantum
+		volatile cl_uint num_stream_waiting; //work units waiting in the streams
+		volatile cl_uint num_stream_admitted; //work units let out of the streams and not taken yet
+
+		cl_bool deadline_first; //the policy orders the work units with a deadline earliest deadline first
+		volatile cl_uint num_deadline_units; //completed work units which had a deadline
+		volatile cl_uint num_missed_deadlines; //of those, the ones completed after their deadline
 
 	void work_pool_scheduler(int device_id);
 	friend void *pthread_scheduler(void *work_pool_scheduler_arg);
+	friend void CL_CALLBACK work_unit_event_callback(cl_event event, cl_int event_status, void* user_data);
 
 	work_pool_context work_pool_get_contexts();
 	void work_units_copy(work_unit* work_unit_from, work_unit* work_unit_to);
-	void enqueue(work_unit* work_unit, cl_uint priority, cl_int* status);
-	void extract_and_distribute(_work_pool_context context, 		              
+	void enqueue(work_unit* work_unit, cl_uint priority, cl_int* status, work_unit_handle* handle = NULL);
+	void enqueue(work_unit* work_unit, cl_uint priority, cl_time deadline, cl_int* status, work_unit_handle* handle = NULL);
+	void try_enqueue(work_unit* work_unit, cl_uint priority, cl_int* status, work_unit_handle* handle = NULL);
+	void enqueue_for(work_unit* work_unit, cl_uint priority, double timeout, cl_int* status, work_unit_handle* handle = NULL);
+	void enqueue_batch(work_unit** work_units, const cl_uint* priorities, size_t num_units, cl_int* status, work_unit_handle* handles = NULL);
+	size_t enqueue_units(work_unit** work_units, const cl_uint* priorities, size_t num_units, double timeout, cl_int* status, work_unit_handle* handles, const cl_time* deadlines);
+	cl_uint reserve_places(size_t num_wanted, double timeout, const struct timeval *deadline);
+	void set_max_capacity(cl_uint max_capacity);
+	void set_thread_affinity(const int* cores, cl_uint num_cores);
+	void* host_alloc(int device_id, size_t size);
+	void host_free(int device_id, void* data, size_t size);
+	staging_buffer acquire_staging(int device_id, size_t size);
+	void release_staging(staging_buffer staging);
+	void free_staging();
+	cl_event staged_write_back(int device_id, cl_mem buffer, size_t buffer_offset, void* data, cl_int size, cl_event after, cl_int* status);
+	cl_int create_stream(const char* name, double weight, cl_int* status);
+	void set_stream_weight(cl_int stream, double weight, cl_int* status);
+	void stream_push(work_unit* work_unit);
+	void stream_dispatch();
+	cl_bool submit(work_unit* work_unit, cl_uint priority, work_unit_handle* handle, cl_time deadline);
+	void make_ready(work_unit* work_unit);
+	void dependency_released(work_unit* work_unit);
+	void wake_devices();
+	work_unit* acquire(int device_id);
+	void drain_submissions();
+	work_unit* pop_local(int device_id);
+	work_unit* steal(int device_id);
+	work_unit* critical_unit(work_pool_deque queue, int thief);
+	void rank_raised(work_unit* work_unit, double rank);
+	double estimate_cost(work_unit* work_unit);
+	cl_uint extract_and_distribute(_work_pool_context context, 		              
 		void (*pfn_init_callback)(work_pool *, _work_pool_context, work_unit *, void*),	
 		void* init_args,							
 		void (*pfn_finalize_callback)(work_pool *, _work_pool_context, void*),	
@@ -315,14 +712,45 @@ class work_pool {
 		cl_int* status);
 
 	cl_mem request_buffer(_work_pool_context context, void *data, cl_int size, char* desc = NULL, cl_bool init = CL_FALSE);
+	cl_mem acquire_buffer(_work_pool_context context, void *data, cl_int size, cl_bool read_only_flag);
+	cl_mem acquire_slice(_work_pool_context context, buffer_entry slice, cl_bool read_only_flag);
+	cl_mem acquire_chunk_buffer(_work_pool_context context, void *data, cl_int size);
+	void fetch_buffer(_work_pool_context context, buffer_entry entry);
+	void transfer_buffer(buffer_entry entry, int source, int destination);
+	buffer_entry find_buffer_entry(void *data, cl_int size = -1);
+	buffer_entry find_array_entry(void *data, cl_int size = -1);
+	buffer_entry slice_buffer_entry(void *data, cl_int size);
+	void insert_buffer_entry(buffer_entry entry);
+	void index_array_entry(buffer_entry entry);
+	void buffer_wait_list(void *data, int device_id, cl_int flag, std::vector<cl_event> &wait_list);
+	void buffer_record_event(void *data, int device_id, cl_int flag, cl_event event);
+	void buffer_written_back(void *data, cl_int size, int device_id, cl_event event);
+	void record_transfer(int device_id, cl_int size, double time);
+	cl_ulong bytes_to_migrate(work_unit* work_unit, int device_id);
+	void migration_costs(work_unit* work_unit, cl_ulong* bytes_resident, cl_ulong* bytes_to_migrate);
+	int prefer_resident(work_unit* work_unit, const double* finish);
+	void buffer_take_host(void *data, int device_id, std::vector<cl_event> &wait_list);
+
+	cl_uint split_and_distribute(work_unit* work_unit, int device_id, cl_int* status);
+	cl_bool run_split_chunk(int device_id, cl_int* status);
+	void issue_chunk(work_unit* work_unit, int device_id, size_t begin_group, size_t end_group, cl_int* status);
+	void set_split_weight(int device_id, double weight);
+
+	void set_inflight_depth(int device_id, cl_uint depth);
+	void set_recycle_limit(int device_id, cl_ulong bytes);
+	cl_mem create_device_buffer(_work_pool_context context, cl_int size, cl_int* status);
+	void recycle_device_buffer(int device_id, cl_mem buffer);
+	void trim_recycled(int device_id, cl_ulong limit);
+	void unit_complete(work_unit* work_unit);
 
 	void init_buffer_table(_buffer_table buffer_table);
 
 	
 
-	cl_uint query();
+	cl_uint query(int device_id = -1);
 
 	void reset_buffer(int thread_id);
+	void wait_idle();
 	void finish();
 
 private:
@@ -343,13 +771,16 @@ typedef struct
 #define WRITE_ONLY 2
 #define READ_WRITE 3
 
+//coherence states of the device copies of an array, MESI
+#define BUFFER_INVALID 0 //no current copy on the device
+#define BUFFER_SHARED 1 //current, other devices may hold it too
+#define BUFFER_EXCLUSIVE 2 //the only device copy, the host array is current
+#define BUFFER_MODIFIED 3 //the only current copy, the host array is stale
+
 #define INT_ARRAY_TYPE 0
 #define FLOAT_ARRAY_TYPE 1
 #define INT_TYPE 2
 
-#define STAY 0 //stay
-#define UP 1 //more busier
-#define DOWN 2 //less busier
 
 
 
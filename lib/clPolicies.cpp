@@ -0,0 +1,654 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <map>
+#include <string>
+#include <vector>
+#include <CL/cl.h>
+#include "clExtensions.h"
+
+//! Registered scheduling policies
+/*!
+Built-in policies are registered lazily the first time the table is used,
+user policies can be added with work_pool_register_policy before the work
+pool is initialized. The names are copied, the caller's string may go away.
+*/
+typedef struct {
+	char* name;
+	work_pool_policy_factory factory;
+} _policy_registry_entry;
+
+static _policy_registry_entry policy_registry[MAX_POLICIES];
+static int num_registered_policies = 0;
+static int builtin_policies_registered = 0;
+
+static void register_builtin_policies();
+
+//! Default placement: the device with the fewest queued work units
+/*!
+Among devices with about as few units, the one holding the most of the
+work unit's data
+*/
+int work_pool_policy::place(work_pool *work_pool, work_unit *work_unit)
+{
+	std::vector<double> queued(work_pool->total_num_devices);
+
+	for(unsigned int i=0;i<work_pool->total_num_devices;i++)
+		queued[i] = work_pool->device_queue[i].num_units + 1;
+
+	return work_pool->prefer_resident(work_unit, &queued[0]);
+}
+
+//! Round robin: unit i goes to device (i-1) mod number of devices
+class round_robin_policy : public work_pool_policy {
+
+public:
+
+	const char* name() { return "round_robin"; }
+
+	int place(work_pool *work_pool, work_unit *work_unit)
+	{
+		return (work_unit->unit_index-1) % (work_pool->total_num_devices);
+	}
+
+	cl_bool steal(work_pool *, int) { return CL_FALSE; }
+
+	cl_int select(work_pool *, int, cl_uint)
+	{
+		return POLICY_TAKE;
+	}
+};
+
+//! One device: every unit runs on device 0, the other devices stay idle
+class one_device_policy : public work_pool_policy {
+
+public:
+
+	const char* name() { return "one_device"; }
+
+	int place(work_pool *, work_unit *) { return 0; }
+
+	cl_bool steal(work_pool *, int) { return CL_FALSE; }
+
+	cl_int select(work_pool *, int device_id, cl_uint)
+	{
+		if(device_id == 0)
+			return POLICY_TAKE;
+
+		return POLICY_RETIRE;
+	}
+};
+
+//! Greedy: every device takes the next unit as soon as it is free
+class greedy_policy : public work_pool_policy {
+
+public:
+
+	const char* name() { return "greedy"; }
+
+	cl_int select(work_pool *, int, cl_uint)
+	{
+		return POLICY_TAKE;
+	}
+};
+
+//! Static ability: fixed share of the total units per device
+/*!
+Device 0 and device 1 take 8/16 of the units each, the other devices
+are not used.
+*/
+class static_ability_policy : public work_pool_policy {
+
+public:
+
+	static_ability_policy() : num_placed(0) {}
+
+	const char* name() { return "static_ability"; }
+
+	int place(work_pool *work_pool, work_unit *)
+	{
+		unsigned int placed = WP_ATOMIC_ADD(&this->num_placed, 1);
+
+		if(work_pool->total_num_devices < 2)
+			return 0;
+
+		return placed % 2;
+	}
+
+	cl_int select(work_pool *work_pool, int device_id, cl_uint)
+	{
+		unsigned int share;
+
+		if(device_id == 0 || device_id == 1)
+			share = (work_pool->total_unfinished_work_units * 8)/16;
+		else
+			return POLICY_RETIRE;
+
+		if(work_pool->num_on_this_device[device_id] >= share)
+			return POLICY_RETIRE;
+
+		return POLICY_TAKE;
+	}
+
+private:
+
+	unsigned int num_placed;
+};
+
+//! Dynamic: adaptive balancing by smoothed throughput
+/*!
+Keeps an exponentially smoothed throughput (work units per ms) for every
+device, seeded by compute capability until the device has completed a unit.
+Units are queued where they are expected to finish first, or where their
+data is when another device finishes about as early, and every device
+keeps taking while its share of the remaining units is at least one; in the
+tail a device only takes a unit it would finish before any other device.
+*/
+class dynamic_policy : public work_pool_policy {
+
+public:
+
+	dynamic_policy() : throughput(NULL) { pthread_mutex_init(&this->throughput_mutex, NULL); }
+
+	~dynamic_policy()
+	{
+		pthread_mutex_destroy(&this->throughput_mutex);
+		free(this->throughput);
+	}
+
+	const char* name() { return "dynamic"; }
+
+	void init(work_pool *work_pool)
+	{
+		this->throughput = (double *)malloc(sizeof(double) * work_pool->total_num_devices);
+		for(unsigned int i=0;i<work_pool->total_num_devices;i++)
+			this->throughput[i] = 0;
+	}
+
+	int place(work_pool *work_pool, work_unit *work_unit)
+	{
+		std::vector<double> finish(work_pool->total_num_devices);
+
+		pthread_mutex_lock (&this->throughput_mutex);
+		for(unsigned int i=0;i<work_pool->total_num_devices;i++)
+			finish[i] = (work_pool->device_queue[i].num_units + outstanding(work_pool, i) + 1) / this->rate(work_pool, i);
+		pthread_mutex_unlock (&this->throughput_mutex);
+
+		//close finish estimates are settled by the data already on the devices
+		return work_pool->prefer_resident(work_unit, &finish[0]);
+	}
+
+	//! The mean time per unit over the devices, once a device has been measured
+	double cost(work_pool *work_pool, work_unit *)
+	{
+		double total = 0;
+		cl_bool measured = CL_FALSE;
+
+		pthread_mutex_lock (&this->throughput_mutex);
+		for(unsigned int i=0;i<work_pool->total_num_devices;i++)
+		{
+			if(this->throughput[i] > 0)
+				measured = CL_TRUE;
+			total += 1 / this->rate(work_pool, i);
+		}
+		pthread_mutex_unlock (&this->throughput_mutex);
+
+		//before any measurement the rates are compute capabilities, not units per ms
+		if(!measured)
+			return HEFT_DEFAULT_ESTIMATE;
+
+		return total / work_pool->total_num_devices;
+	}
+
+	cl_int select(work_pool *work_pool, int device_id, cl_uint)
+	{
+		int remaining = work_pool->total_unfinished_work_units;
+		for(unsigned int i=0;i<work_pool->total_num_devices;i++)
+			remaining -= work_pool->num_on_this_device[i];
+
+		if(remaining <= 0)
+			return POLICY_RETIRE;
+
+		cl_int decision = POLICY_TAKE;
+
+		pthread_mutex_lock (&this->throughput_mutex);
+		double total_rate = 0;
+		for(unsigned int i=0;i<work_pool->total_num_devices;i++)
+			total_rate += this->rate(work_pool, i);
+
+		if(remaining * this->rate(work_pool, device_id) / total_rate < 1)
+		{
+			//tail: leave the unit to a device that finishes it earlier
+			double finish = (outstanding(work_pool, device_id) + 1) / this->rate(work_pool, device_id);
+			for(unsigned int i=0;i<work_pool->total_num_devices;i++)
+			{
+				if(i != (unsigned int)device_id && (outstanding(work_pool, i) + 1) / this->rate(work_pool, i) < finish)
+				{
+					decision = POLICY_SKIP;
+					break;
+				}
+			}
+		}
+		pthread_mutex_unlock (&this->throughput_mutex);
+
+		return decision;
+	}
+
+	void complete(work_pool *, int device_id, work_unit *work_unit)
+	{
+		if(work_unit->kernel_time <= 0)
+			return;
+
+		pthread_mutex_lock (&this->throughput_mutex);
+		if(this->throughput[device_id] <= 0)
+			this->throughput[device_id] = 1 / work_unit->kernel_time;
+		else
+			this->throughput[device_id] = DYNAMIC_SMOOTHING / work_unit->kernel_time + (1 - DYNAMIC_SMOOTHING) * this->throughput[device_id];
+		pthread_mutex_unlock (&this->throughput_mutex);
+	}
+
+private:
+
+	pthread_mutex_t throughput_mutex;
+	double *throughput; //smoothed work units per ms, 0 until the device completed a unit
+
+	static double capability(work_pool *work_pool, int device_id)
+	{
+		double capability = (double)work_pool->context[device_id].device_max_compute_units * work_pool->context[device_id].device_max_frequency;
+		return capability > 0 ? capability : 1;
+	}
+
+	static unsigned int outstanding(work_pool *work_pool, int device_id)
+	{
+		return work_pool->num_on_this_device[device_id] - work_pool->num_completed_on_this_device[device_id];
+	}
+
+	//! Throughput of a device, unmeasured devices are scaled from the measured ones by capability
+	double rate(work_pool *work_pool, int device_id)
+	{
+		if(this->throughput[device_id] > 0)
+			return this->throughput[device_id];
+
+		double measured = 0, measured_capability = 0;
+		for(unsigned int i=0;i<work_pool->total_num_devices;i++)
+		{
+			if(this->throughput[i] > 0)
+			{
+				measured += this->throughput[i];
+				measured_capability += capability(work_pool, i);
+			}
+		}
+
+		if(measured > 0)
+			return measured * capability(work_pool, device_id) / measured_capability;
+
+		return capability(work_pool, device_id);
+	}
+};
+
+//! HEFT: earliest estimated finish time per work unit
+/*!
+Keeps a smoothed execution time per kernel and device. A work unit is
+placed on the device where the estimated backlog, transfer and execution
+time add up to the earliest finish. Kernels not measured on a device yet
+are estimated from the times measured on that device so far, or from the
+times on other devices scaled by compute capability.
+*/
+class heft_policy : public work_pool_policy {
+
+public:
+
+	heft_policy() : backlog(NULL) { pthread_mutex_init(&this->model_mutex, NULL); }
+
+	~heft_policy()
+	{
+		pthread_mutex_destroy(&this->model_mutex);
+		free(this->backlog);
+	}
+
+	const char* name() { return "heft"; }
+
+	void init(work_pool *work_pool)
+	{
+		this->backlog = (double *)malloc(sizeof(double) * work_pool->total_num_devices);
+		for(unsigned int i=0;i<work_pool->total_num_devices;i++)
+			this->backlog[i] = 0;
+	}
+
+	int place(work_pool *work_pool, work_unit *work_unit)
+	{
+		int best_device = 0;
+		double best_finish = 0;
+		double best_estimate = 0;
+
+		//the buffer table is read before model_mutex, placements do not wait for each other on it
+		std::vector<cl_ulong> to_migrate(work_pool->total_num_devices);
+		work_pool->migration_costs(work_unit, NULL, &to_migrate[0]);
+
+		pthread_mutex_lock (&this->model_mutex);
+		for(unsigned int i=0;i<work_pool->total_num_devices;i++)
+		{
+			double estimate = this->estimate(work_pool, work_unit, i);
+			double transfer = to_migrate[i] / work_pool->transfer_rate[i];
+			double finish = this->backlog[i] + transfer + estimate;
+
+			if(i == 0 || finish < best_finish)
+			{
+				best_device = i;
+				best_finish = finish;
+				best_estimate = transfer + estimate;
+			}
+		}
+		this->backlog[best_device] += best_estimate;
+		pthread_mutex_unlock (&this->model_mutex);
+
+		work_unit->estimated_time = best_estimate;
+
+		return best_device;
+	}
+
+	//! The mean of the kernel estimates over the devices, as in the upward rank of HEFT
+	double cost(work_pool *work_pool, work_unit *work_unit)
+	{
+		double total = 0;
+
+		pthread_mutex_lock (&this->model_mutex);
+		for(unsigned int i=0;i<work_pool->total_num_devices;i++)
+			total += this->estimate(work_pool, work_unit, i);
+		pthread_mutex_unlock (&this->model_mutex);
+
+		return total / work_pool->total_num_devices;
+	}
+
+	cl_int select(work_pool *, int, cl_uint)
+	{
+		return POLICY_TAKE;
+	}
+
+	void complete(work_pool *work_pool, int device_id, work_unit *work_unit)
+	{
+		pthread_mutex_lock (&this->model_mutex);
+
+		//the unit may have been stolen, its estimate was charged to the device it was placed on
+		this->backlog[work_unit->home_device] -= work_unit->estimated_time;
+		if(this->backlog[work_unit->home_device] < 0)
+			this->backlog[work_unit->home_device] = 0;
+
+		std::vector<double> &model = this->kernel_model(work_pool, work_unit);
+		if(model[device_id] <= 0)
+			model[device_id] = work_unit->kernel_time;
+		else
+			model[device_id] = HEFT_SMOOTHING * work_unit->kernel_time + (1 - HEFT_SMOOTHING) * model[device_id];
+
+		pthread_mutex_unlock (&this->model_mutex);
+	}
+
+private:
+
+	pthread_mutex_t model_mutex;
+	double *backlog; //estimated ms of work placed but not finished, per device
+	std::map<std::string, std::vector<double> > models; //smoothed ms per kernel and device, 0 if not measured
+
+	std::vector<double>& kernel_model(work_pool *work_pool, work_unit *work_unit)
+	{
+		std::string kernel_name(work_unit->kernel_name != NULL ? work_unit->kernel_name : "");
+		std::map<std::string, std::vector<double> >::iterator it = this->models.find(kernel_name);
+
+		if(it == this->models.end())
+			it = this->models.insert(std::make_pair(kernel_name, std::vector<double>(work_pool->total_num_devices, 0.0))).first;
+
+		return it->second;
+	}
+
+	static double capability(work_pool *work_pool, int device_id)
+	{
+		return (double)work_pool->context[device_id].device_max_compute_units * work_pool->context[device_id].device_max_frequency;
+	}
+
+	double estimate(work_pool *work_pool, work_unit *work_unit, int device_id)
+	{
+		std::vector<double> &model = this->kernel_model(work_pool, work_unit);
+
+		if(model[device_id] > 0)
+			return model[device_id];
+
+		//seed from the execution times measured on this device
+		unsigned int num = work_pool->num_completed_on_this_device[device_id];
+		if(num > work_pool->total_unfinished_work_units)
+			num = work_pool->total_unfinished_work_units;
+		if(num > 0)
+		{
+			double sum = 0;
+			for(unsigned int i=0;i<num;i++)
+				sum += work_pool->execution_time_queue_per_device[device_id][i];
+			return sum / num;
+		}
+
+		//scale the time measured on another device by compute capability
+		for(unsigned int i=0;i<work_pool->total_num_devices;i++)
+		{
+			if(model[i] > 0 && capability(work_pool, device_id) > 0)
+				return model[i] * capability(work_pool, i) / capability(work_pool, device_id);
+		}
+
+		//nothing measured yet, faster devices get the first units
+		double max_capability = 0;
+		for(unsigned int i=0;i<work_pool->total_num_devices;i++)
+		{
+			if(capability(work_pool, i) > max_capability)
+				max_capability = capability(work_pool, i);
+		}
+		if(capability(work_pool, device_id) > 0)
+			return HEFT_DEFAULT_ESTIMATE * max_capability / capability(work_pool, device_id);
+
+		return HEFT_DEFAULT_ESTIMATE;
+	}
+};
+
+//! EDF: earliest deadline first
+/*!
+Device queues take the work units with a deadline earliest deadline first.
+Every device keeps a smoothed time per work unit, measured from
+unit_start_time and unit_end_time; a work unit queued behind another one
+on the same device is only charged from the other one's end. A work unit
+is placed on a device expected to finish it before its deadline, trading
+an earlier finish for less data movement within LOCALITY_TOLERANCE; when
+no device can make it, among all the devices.
+*/
+class edf_policy : public work_pool_policy {
+
+public:
+
+	edf_policy() : service(NULL), last_end(NULL) { pthread_mutex_init(&this->service_mutex, NULL); }
+
+	~edf_policy()
+	{
+		pthread_mutex_destroy(&this->service_mutex);
+		free(this->service);
+		free(this->last_end);
+	}
+
+	const char* name() { return "edf"; }
+
+	cl_bool earliest_deadline_first() { return CL_TRUE; }
+
+	void init(work_pool *work_pool)
+	{
+		this->service = (double *)malloc(sizeof(double) * work_pool->total_num_devices);
+		this->last_end = (cl_time *)malloc(sizeof(cl_time) * work_pool->total_num_devices);
+		for(unsigned int i=0;i<work_pool->total_num_devices;i++)
+		{
+			this->service[i] = 0;
+			this->last_end[i] = 0;
+		}
+	}
+
+	int place(work_pool *work_pool, work_unit *work_unit)
+	{
+		std::vector<double> finish(work_pool->total_num_devices);
+		cl_bool can_meet = CL_FALSE;
+		cl_time now;
+		cl_getTime(&now);
+
+		pthread_mutex_lock (&this->service_mutex);
+		for(unsigned int i=0;i<work_pool->total_num_devices;i++)
+		{
+			unsigned int backlog = work_pool->device_queue[i].num_units + work_pool->num_on_this_device[i] - work_pool->num_completed_on_this_device[i];
+			finish[i] = (backlog + 1) * this->service_time(work_pool, i);
+			if(work_unit->deadline != 0 && finish[i] <= cl_computeTime(now, work_unit->deadline))
+				can_meet = CL_TRUE;
+		}
+		pthread_mutex_unlock (&this->service_mutex);
+
+		//devices missing the deadline only compete when all of them do
+		if(can_meet)
+		{
+			double slack = cl_computeTime(now, work_unit->deadline);
+			for(unsigned int i=0;i<work_pool->total_num_devices;i++)
+			{
+				if(finish[i] > slack)
+					finish[i] = DBL_MAX;
+			}
+		}
+
+		return work_pool->prefer_resident(work_unit, &finish[0]);
+	}
+
+	cl_int select(work_pool *, int, cl_uint)
+	{
+		return POLICY_TAKE;
+	}
+
+	void complete(work_pool *work_pool, int device_id, work_unit *work_unit)
+	{
+		double time = work_unit->kernel_time;
+		cl_uint unit_index = work_unit->unit_index;
+
+		pthread_mutex_lock (&this->service_mutex);
+		if(unit_index <= work_pool->total_unfinished_work_units && work_pool->unit_start_time[unit_index] != 0)
+		{
+			cl_time start = work_pool->unit_start_time[unit_index];
+			cl_time end = work_pool->unit_end_time[unit_index];
+			time = cl_computeTime(start > this->last_end[device_id] ? start : this->last_end[device_id], end);
+			if(end > this->last_end[device_id])
+				this->last_end[device_id] = end;
+		}
+
+		if(time > 0)
+		{
+			if(this->service[device_id] <= 0)
+				this->service[device_id] = time;
+			else
+				this->service[device_id] = EDF_SMOOTHING * time + (1 - EDF_SMOOTHING) * this->service[device_id];
+		}
+		pthread_mutex_unlock (&this->service_mutex);
+	}
+
+private:
+
+	pthread_mutex_t service_mutex;
+	double *service; //smoothed ms per work unit, 0 until the device completed a unit
+	cl_time *last_end; //completion of the last work unit, per device
+
+	//! Time per work unit of a device, unmeasured devices are scaled from the measured ones by capability
+	double service_time(work_pool *work_pool, int device_id)
+	{
+		if(this->service[device_id] > 0)
+			return this->service[device_id];
+
+		for(unsigned int i=0;i<work_pool->total_num_devices;i++)
+		{
+			double capability = (double)work_pool->context[i].device_max_compute_units * work_pool->context[i].device_max_frequency;
+			double own_capability = (double)work_pool->context[device_id].device_max_compute_units * work_pool->context[device_id].device_max_frequency;
+			if(this->service[i] > 0 && capability > 0 && own_capability > 0)
+				return this->service[i] * capability / own_capability;
+		}
+
+		return HEFT_DEFAULT_ESTIMATE;
+	}
+};
+
+static work_pool_policy* create_round_robin_policy() { return new round_robin_policy(); }
+static work_pool_policy* create_one_device_policy() { return new one_device_policy(); }
+static work_pool_policy* create_greedy_policy() { return new greedy_policy(); }
+static work_pool_policy* create_static_ability_policy() { return new static_ability_policy(); }
+static work_pool_policy* create_dynamic_policy() { return new dynamic_policy(); }
+static work_pool_policy* create_heft_policy() { return new heft_policy(); }
+static work_pool_policy* create_edf_policy() { return new edf_policy(); }
+
+static void register_builtin_policies()
+{
+	if(builtin_policies_registered)
+		return;
+	builtin_policies_registered = 1;
+
+	work_pool_register_policy("round_robin", create_round_robin_policy);
+	work_pool_register_policy("static_ability", create_static_ability_policy);
+	work_pool_register_policy("dynamic", create_dynamic_policy);
+	work_pool_register_policy("one_device", create_one_device_policy);
+	work_pool_register_policy("greedy", create_greedy_policy);
+	work_pool_register_policy("heft", create_heft_policy);
+	work_pool_register_policy("edf", create_edf_policy);
+}
+
+//! Register a scheduling policy
+/*!
+Register a scheduling policy under a name, a policy registered with the
+name of an existing one replaces it
+\param name, The name used to select the policy in work_pool::init or WORKPOOL_POLICY
+\param factory, The function creating a new instance of the policy
+\return CL_SUCCESS, CL_OUT_OF_RESOURCES if the table is full, or CL_OUT_OF_HOST_MEMORY
+*/
+cl_int work_pool_register_policy(const char* name, work_pool_policy_factory factory)
+{
+	if(name == NULL || factory == NULL)
+		return CL_INVALID_VALUE;
+
+	register_builtin_policies();
+
+	for(int i=0;i<num_registered_policies;i++)
+	{
+		if(strcmp(policy_registry[i].name, name) == 0)
+		{
+			policy_registry[i].factory = factory;
+			return CL_SUCCESS;
+		}
+	}
+
+	if(num_registered_policies == MAX_POLICIES)
+	{
+		printf("Policy table is full, can not register policy %s\n", name);
+		return CL_OUT_OF_RESOURCES;
+	}
+
+	policy_registry[num_registered_policies].name = strdup(name);
+	if(policy_registry[num_registered_policies].name == NULL)
+		return CL_OUT_OF_HOST_MEMORY;
+	policy_registry[num_registered_policies].factory = factory;
+	num_registered_policies++;
+
+	return CL_SUCCESS;
+}
+
+//! Create a scheduling policy
+/*!
+Create a scheduling policy by name
+\param name, The registered name of the policy
+\return A new policy instance, or NULL if no policy has this name
+*/
+work_pool_policy* work_pool_create_policy(const char* name)
+{
+	register_builtin_policies();
+
+	if(name == NULL)
+		return NULL;
+
+	for(int i=0;i<num_registered_policies;i++)
+	{
+		if(strcmp(policy_registry[i].name, name) == 0)
+			return policy_registry[i].factory();
+	}
+
+	return NULL;
+}
@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <CL/cl.h>
+#include <clExtensions.h>
+
+// Throughput of the work pool submission ring, in units per second, for
+// 1..MAX_THREADS producer and consumer threads
+
+#define MAX_THREADS 8
+#define RING_CAPACITY 1024
+#define UNITS_PER_PRODUCER 1000000
+
+typedef struct {
+	_work_pool_ring *ring;
+	volatile cl_uint *num_popped;
+	cl_uint num_units;
+} ringbench_data;
+
+void * ringbench_producer(void* arg)
+{
+	ringbench_data *data = (ringbench_data *)arg;
+
+	for(cl_uint i=0;i<data->num_units;i++)
+	{
+		//the handles are never dereferenced
+		while(!work_pool_ring_push(data->ring, (void *)(size_t)(i+1)))
+			sched_yield();
+	}
+
+	return NULL;
+}
+
+void * ringbench_consumer(void* arg)
+{
+	ringbench_data *data = (ringbench_data *)arg;
+
+	while(*data->num_popped < data->num_units)
+	{
+		if(work_pool_ring_pop(data->ring) != NULL)
+			WP_ATOMIC_ADD(data->num_popped, 1);
+		else
+			sched_yield();
+	}
+
+	return NULL;
+}
+
+int main( int argc, char* argv[] )
+{
+	cl_uint units_per_producer = UNITS_PER_PRODUCER;
+	if(argc > 1)
+		units_per_producer = atoi(argv[1]);
+
+	printf("producers consumers units/s\n");
+
+	for(int producers=1;producers<=MAX_THREADS;producers*=2)
+	{
+		for(int consumers=1;consumers<=MAX_THREADS;consumers*=2)
+		{
+			_work_pool_ring ring;
+			volatile cl_uint num_popped = 0;
+			pthread_t threads[2*MAX_THREADS];
+			ringbench_data producer_data, consumer_data;
+			cl_time start, end;
+
+			if(work_pool_ring_init(&ring, RING_CAPACITY) != CL_SUCCESS)
+				exit(1);
+
+			producer_data.ring = &ring;
+			producer_data.num_popped = &num_popped;
+			producer_data.num_units = units_per_producer;
+			consumer_data = producer_data;
+			consumer_data.num_units = units_per_producer * producers;
+
+			cl_getTime(&start);
+			for(int i=0;i<consumers;i++)
+				pthread_create(&threads[i], NULL, ringbench_consumer, &consumer_data);
+			for(int i=0;i<producers;i++)
+				pthread_create(&threads[consumers+i], NULL, ringbench_producer, &producer_data);
+			for(int i=0;i<consumers+producers;i++)
+				pthread_join(threads[i], NULL);
+			cl_getTime(&end);
+
+			double time = cl_computeTime(start, end); //ms
+			printf("%9d %9d %.0f\n", producers, consumers, consumer_data.num_units / time * 1000.0);
+
+			work_pool_ring_release(&ring);
+		}
+	}
+
+	return 0;
+}
@@ -118,10 +118,16 @@ int main( int argc, char* argv[] )
 		if(cl_errChk(status, "set argument", true)) 					
 			exit(1);
 
+		work_unit *work_unit_batch[SAME_VEC_NUMBER];
+		cl_uint priority_batch[SAME_VEC_NUMBER];
 		for(int j=0;j<SAME_VEC_NUMBER;j++)
 		{		
-			work_pool_vec.enqueue(&work_unit_vec[i], PRIORITY_LEVEL-j, &status);
+			work_unit_batch[j] = &work_unit_vec[i];
+			priority_batch[j] = PRIORITY_LEVEL-j;
 		}	
+		work_pool_vec.enqueue_batch(work_unit_batch, priority_batch, SAME_VEC_NUMBER, &status);
+		if(cl_errChk(status, "Enqueue work units", true)) 					
+			exit(1);
 
 	}
 